@@ -102,6 +102,9 @@ void setup() {
 
 void loop() {
 
+  // send what a busy USB endpoint held back, sendState() never waits
+  Joystick.sendPending();
+
   // System Disabled
   if (digitalRead(A0) != 0)
   {
@@ -0,0 +1,118 @@
+// Checks the fixed-point force feedback math on the board itself.
+//
+// The motion estimator is fed a constant velocity on axis 0 and a constant
+// acceleration on axis 1 at 1 kHz, and the Q15 sine table behind the periodic
+// effects is compared with sin(). Each line prints the value the library
+// converged to, the exact value and PASS or FAIL; a changed shift constant
+// shows up as a FAIL, usually off by a power of two.
+//
+// Open the Serial Monitor at 115200 baud, the check runs once after reset.
+//
+// NOTE: This sketch file is for use with Arduino Leonardo, Arduino Micro and
+//       Arduino Due.
+//--------------------------------------------------------------------
+
+#include "JoystickS418.h"
+#include "FFBWaveTable.h"
+
+using namespace S418::JoystickFfb;
+
+Joystick_ Joystick(JOYSTICK_DEFAULT_REPORT_ID, JOYSTICK_TYPE_JOYSTICK, 0, 0,
+  true, true, false, false, false, false, false, false, false, false, false);
+
+EffectParams effectParams[MAX_FFB_AXIS_COUNT];
+
+#define TICK_RATE     1000     // updateAxisPosition() calls per second
+#define TICKS         3000     // 3 s, positions stay below 2^23 counts
+#define AVERAGE_TICKS 1000     // outputs are averaged over the last second
+#define VELOCITY      5000     // counts/s on axis 0
+#define ACCELERATION  1000000L // counts/s^2 on axis 1, one count per tick^2
+
+int failures = 0;
+
+void check(const __FlashStringHelper* name, int32_t value, int32_t expected, int32_t tolerance) {
+  bool pass = abs(value - expected) <= tolerance;
+  if (!pass) failures++;
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(value);
+  Serial.print(F(" expected "));
+  Serial.print(expected);
+  Serial.print(F(" +-"));
+  Serial.print(tolerance);
+  Serial.println(pass ? F(" PASS") : F(" FAIL"));
+}
+
+void checkMotionEstimator() {
+  Joystick.setEffectParams(effectParams);
+  Joystick.setMotionEstimator(TICK_RATE);
+
+  // positions follow the real time of each call, so timer jitter is part of the check
+  int64_t velocitySum = 0, positionChangeSum = 0, rampAccelerationSum = 0;
+  int64_t accelerationSum = 0, acceleratingVelocitySum = 0, expectedVelocitySum = 0;
+  uint32_t start = micros();
+  uint32_t next = start;
+  for (uint16_t tick = 0; tick < TICKS; tick++) {
+    while ((int32_t)(micros() - next) < 0);
+    next += 1000000UL / TICK_RATE;
+    uint64_t t = micros() - start; // us
+    Joystick.updateAxisPosition(0, (int32_t)(t * VELOCITY / 1000000));
+#if MAX_FFB_AXIS_COUNT >= 2
+    Joystick.updateAxisPosition(1, (int32_t)(t * t / 1000000 * (ACCELERATION / 2) / 1000000));
+#endif
+    if (tick >= TICKS - AVERAGE_TICKS) {
+      velocitySum += effectParams[0].damperVelocity;
+      positionChangeSum += effectParams[0].frictionPositionChange;
+      rampAccelerationSum += effectParams[0].inertiaAcceleration;
+#if MAX_FFB_AXIS_COUNT >= 2
+      accelerationSum += effectParams[1].inertiaAcceleration;
+      acceleratingVelocitySum += effectParams[1].damperVelocity;
+      expectedVelocitySum += (int32_t)(t * ACCELERATION / 1000000);
+#endif
+    }
+  }
+
+  check(F("ramp damperVelocity"), velocitySum / AVERAGE_TICKS, VELOCITY, VELOCITY / 50);
+  check(F("ramp frictionPositionChange"), positionChangeSum / AVERAGE_TICKS, VELOCITY / TICK_RATE, 1);
+  check(F("ramp inertiaAcceleration"), rampAccelerationSum / AVERAGE_TICKS, 0, ACCELERATION / 50);
+#if MAX_FFB_AXIS_COUNT >= 2
+  check(F("accelerating inertiaAcceleration"), accelerationSum / AVERAGE_TICKS, ACCELERATION, ACCELERATION / 50);
+  check(F("accelerating damperVelocity"), acceleratingVelocitySum / AVERAGE_TICKS,
+    expectedVelocitySum / AVERAGE_TICKS, expectedVelocitySum / AVERAGE_TICKS / 50);
+#endif
+}
+
+void checkSineTable() {
+  // linear interpolation of the quarter-wave table is within 3 counts of Q15
+  int32_t maxError = 0;
+  uint16_t worstPhase = 0;
+  for (uint32_t phase = 0; phase < 65536UL; phase += 97) {
+    int32_t exact = lround(sin(phase * (2 * PI / 65536.0)) * 32767);
+    int32_t error = abs(FfbSine(phase) - exact);
+    if (error > maxError) {
+      maxError = error;
+      worstPhase = phase;
+    }
+  }
+  check(F("FfbSine(90deg)"), FfbSine(0x4000), 32767, 0);
+  check(F("FfbSine(270deg)"), FfbSine(0xC000), -32767, 0);
+  Serial.print(F("FfbSine worst phase "));
+  Serial.println(worstPhase);
+  check(F("FfbSine max error"), maxError, 0, 3);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+  Joystick.begin();
+
+  checkMotionEstimator();
+  checkSineTable();
+  Serial.print(failures);
+  Serial.println(F(" failures"));
+}
+
+void loop() {
+  // send what a busy USB endpoint held back, sendState() never waits
+  Joystick.sendPending();
+}
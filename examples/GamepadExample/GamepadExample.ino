@@ -43,6 +43,9 @@ int lastButtonState[5] = {0,0,0,0,0};
 
 void loop() {
 
+  // send what a busy USB endpoint held back, sendState() never waits
+  Joystick.sendPending();
+
   // Read pin values
   for (int index = 0; index < 5; index++)
   {
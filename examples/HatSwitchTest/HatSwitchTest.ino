@@ -46,6 +46,9 @@ int lastButtonState[2][4] = {{0,0,0,0}, {0,0,0,0}};
 
 void loop() {
 
+  // send what a busy USB endpoint held back, sendState() never waits
+  Joystick.sendPending();
+
   bool valueChanged[2] = {false, false};
   int currentPin = 4;
 
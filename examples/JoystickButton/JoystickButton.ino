@@ -34,6 +34,9 @@ int lastButtonState[4] = {0,0,0,0};
 
 void loop() {
 
+  // send what a busy USB endpoint held back, sendState() never waits
+  Joystick.sendPending();
+
   // Read pin values
   for (int index = 0; index < 4; index++)
   {
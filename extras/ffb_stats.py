@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""Read the USB counters of a controller built with -DDYNAMIC_HID_STATS=1.
+
+--latency reads the force latency histogram instead, which also needs -DFFB_LATENCY_STATS=1.
+Needs the hidapi module (pip install hidapi).
+
+    ffb_stats.py [--vid 0x2341] [--pid 0x8036] [--interval 1.0] [--clear] [--latency]
+"""
+import argparse
+import struct
+import time
+
+import hid
+
+REPORT_ID = 46  # DYNAMIC_HID_STATS_REPORT_ID
+VERSION = 1     # DYNAMIC_HID_STATS_VERSION
+LAYOUT = struct.Struct("<BBHHH8I")  # DynamicHIDStats
+LATENCY_REPORT_ID = 45  # DYNAMIC_HID_LATENCY_REPORT_ID
+LATENCY_BINS = 32  # FFB_LATENCY_BINS
+LATENCY_LAYOUT = struct.Struct("<BBHHHII%dH" % LATENCY_BINS)  # FFBLatencyStats
+FIELDS = ("maxRecvUs", "maxForceUs", "stalledRequests", "inSent", "inBusy", "inFailed",
+          "outReceived", "outDropped", "getReport", "setReport", "otherRequests")
+
+
+def open_device(vid, pid):
+    # the counters live in their own vendor collection, prefer the path that has it
+    infos = sorted(hid.enumerate(vid, pid), key=lambda info: info.get("usage_page") != 0xFF00)
+    if not infos:
+        raise SystemExit("no device %04x:%04x" % (vid, pid))
+    device = hid.device()
+    device.open_path(infos[0]["path"])
+    return device
+
+
+def read_stats(device):
+    data = bytes(device.get_feature_report(REPORT_ID, LAYOUT.size))
+    if len(data) < LAYOUT.size:
+        raise SystemExit("short report: %d bytes" % len(data))
+    values = LAYOUT.unpack(data[:LAYOUT.size])
+    if values[0] != REPORT_ID or values[1] != VERSION:
+        raise SystemExit("unexpected report id %d version %d" % values[:2])
+    return dict(zip(FIELDS, values[2:]))
+
+
+def read_latency(device):
+    data = bytes(device.get_feature_report(LATENCY_REPORT_ID, LATENCY_LAYOUT.size))
+    if len(data) < LATENCY_LAYOUT.size or data[0] != LATENCY_REPORT_ID:
+        raise SystemExit("no latency report, build with -DFFB_LATENCY_STATS=1")
+    values = LATENCY_LAYOUT.unpack(data[:LATENCY_LAYOUT.size])
+    shift, min_us, max_us, p99_us, count, total_us = values[1:7]
+    print("latency us: n %d  min %d  avg %d  p99 %d  max %d" % (
+        count, min_us if count else 0, total_us // count if count else 0, p99_us, max_us))
+    for bin, hits in enumerate(values[7:]):
+        if hits:
+            last = bin == LATENCY_BINS - 1
+            print("  %s%5d  %d" % (">=" if last else "< ", (bin + (not last)) << shift, hits))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--vid", type=lambda v: int(v, 0), default=0x2341)
+    parser.add_argument("--pid", type=lambda v: int(v, 0), default=0x8036)
+    parser.add_argument("--interval", type=float, default=0, help="repeat every N seconds and show rates")
+    parser.add_argument("--clear", action="store_true", help="zero the counters first")
+    parser.add_argument("--latency", action="store_true", help="show the force latency histogram")
+    args = parser.parse_args()
+
+    device = open_device(args.vid, args.pid)
+    if args.latency:
+        if args.clear:
+            device.send_feature_report([LATENCY_REPORT_ID] + [0] * (LATENCY_LAYOUT.size - 1))
+        while True:
+            read_latency(device)
+            if not args.interval:
+                return
+            time.sleep(args.interval)
+
+    if args.clear:
+        device.send_feature_report([REPORT_ID] + [0] * (LAYOUT.size - 1))
+
+    last = None
+    while True:
+        stats = read_stats(device)
+        print("  ".join("%s %d" % (name, value) for name, value in stats.items()))
+        if last is not None:
+            print("  per s: " + "  ".join("%s %.0f" % (name, (stats[name] - last[name]) / args.interval)
+                                          for name in FIELDS[3:]))
+        if not args.interval:
+            break
+        last = stats
+        time.sleep(args.interval)
+
+
+if __name__ == "__main__":
+    main()
@@ -26,6 +26,36 @@
 #ifdef _VARIANT_ARDUINO_DUE_X_
 #define USB_SendControl USBD_SendControl
 #define USB_Send USBD_Send
+#define USB_SendSpace USBD_SendSpace
+#define USB_Recv USBD_Recv
+#define USB_RecvControl USBD_RecvControl
+#define USB_Available USBD_Available
+#endif
+
+static_assert(DYNAMIC_HID_IN_PACKET_SIZE <= USB_EP_SIZE && DYNAMIC_HID_OUT_PACKET_SIZE <= USB_EP_SIZE, "packet size above the endpoint buffer");
+static_assert(DYNAMIC_HID_OUT_PACKET_SIZE >= sizeof(USB_FFBReport_SetEffect_Output_Data_t) &&
+              DYNAMIC_HID_OUT_PACKET_SIZE >= sizeof(USB_FFBReport_SetCustomForceData_Output_Data_t), "OUT packet too small for the PID reports");
+
+#if DYNAMIC_HID_STATS
+static const uint8_t statsReportDescriptor[] PROGMEM = {
+	0x06, 0x00, 0xFF,       // USAGE_PAGE (Vendor Defined 0xFF00)
+	0x09, 0x01,             // USAGE (Vendor Usage 1)
+	0xA1, 0x01,             // COLLECTION (Application)
+	0x85, DYNAMIC_HID_STATS_REPORT_ID, // REPORT_ID
+	0x09, 0x02,             //   USAGE (Vendor Usage 2)
+	0x15, 0x00,             //   LOGICAL_MINIMUM (0)
+	0x26, 0xFF, 0x00,       //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,             //   REPORT_SIZE (8)
+	0x95, sizeof(DynamicHIDStats) - 1, // REPORT_COUNT
+	0xB1, 0x02,             //   FEATURE (Data,Var,Abs)
+#if FFB_LATENCY_STATS
+	0x85, DYNAMIC_HID_LATENCY_REPORT_ID, // REPORT_ID
+	0x09, 0x03,             //   USAGE (Vendor Usage 3)
+	0x95, sizeof(FFBLatencyStats) - 1, // REPORT_COUNT
+	0xB1, 0x02,             //   FEATURE (Data,Var,Abs)
+#endif
+	0xC0                    // END_COLLECTION
+};
 #endif
 
 DynamicHID_& DynamicHID()
@@ -40,8 +70,8 @@ int DynamicHID_::getInterface(uint8_t* interfaceCount)
 	DYNAMIC_HIDDescriptor hidInterface = {
 		D_INTERFACE(pluggedInterface, PID_ENPOINT_COUNT, USB_DEVICE_CLASS_HUMAN_INTERFACE, DYNAMIC_HID_SUBCLASS_NONE, DYNAMIC_HID_PROTOCOL_NONE),
 		D_HIDREPORT(descriptorSize),
-		D_ENDPOINT(USB_ENDPOINT_IN(PID_ENDPOINT_IN), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, 0x01),
-		D_ENDPOINT(USB_ENDPOINT_OUT(PID_ENDPOINT_OUT), USB_ENDPOINT_TYPE_INTERRUPT, USB_EP_SIZE, 0x01)
+		D_ENDPOINT(USB_ENDPOINT_IN(PID_ENDPOINT_IN), USB_ENDPOINT_TYPE_INTERRUPT, DYNAMIC_HID_IN_PACKET_SIZE, DynamicHIDInterval(DYNAMIC_HID_IN_INTERVAL_US)),
+		D_ENDPOINT(USB_ENDPOINT_OUT(PID_ENDPOINT_OUT), USB_ENDPOINT_TYPE_INTERRUPT, DYNAMIC_HID_OUT_PACKET_SIZE, DynamicHIDInterval(DYNAMIC_HID_OUT_INTERVAL_US))
 	};
 	return USB_SendControl(0, &hidInterface, sizeof(hidInterface));
 }
@@ -54,14 +84,12 @@ int DynamicHID_::getDescriptor(USBSetup& setup)
 	// In a HID Class Descriptor wIndex cointains the interface number
 	if (setup.wIndex != pluggedInterface) { return 0; }
 
-	int total = 0;
-	DynamicHIDSubDescriptor* node;
-	for (node = rootNode; node; node = node->next) {
-		int res = USB_SendControl(0, node->data, node->length);
-		if (res == -1)
-			return -1;
-		total += res;
-		res = USB_SendControl(TRANSFER_PGM, node->pid_data, node->pid_length);
+	// one RAM block for all instances, then the PID block straight from PROGMEM
+	int total = USB_SendControl(0, descriptorData, descriptorDataSize);
+	if (total == -1)
+		return -1;
+	if (pidNode) {
+		int res = USB_SendControl(TRANSFER_PGM, pidNode->pid_data, pidNode->pid_length);
 		if (res == -1)
 			return -1;
 		total += res;
@@ -86,25 +114,130 @@ uint8_t DynamicHID_::getShortName(char *name)
 
 void DynamicHID_::AppendDescriptor(DynamicHIDSubDescriptor *node)
 {
-	if (!rootNode) {
+	// the descriptor is copied, the caller may reuse node->data afterwards
+	uint8_t* data = (uint8_t*)realloc(descriptorData, descriptorDataSize + node->length);
+	if (!data)
+		return;
+	if (node->inProgMem)
+		memcpy_P(data + descriptorDataSize, node->data, node->length);
+	else
+		memcpy(data + descriptorDataSize, node->data, node->length);
+	descriptorData = data;
+	descriptorDataSize += node->length;
+	descriptorSize += node->length;
+
+	if (!rootNode)
 		rootNode = node;
-	} else {
-		DynamicHIDSubDescriptor *current = rootNode;
-		while (current->next) {
-			current = current->next;
+	else
+		lastNode->next = node;
+	lastNode = node;
+	// one PID block for the whole interface, attached to the first instance that brings it
+	if (!pidNode && node->pid_data && node->pid_length) {
+		pidNode = node;
+		descriptorSize += node->pid_length;
+	}
+}
+
+uint8_t DynamicHID_::AllocateReportId(uint8_t reportId)
+{
+	// an ID of the PID block, of an earlier instance or past the tracked range moves to the lowest free one,
+	// 0 once all tracked IDs are taken
+	uint8_t index = reportId - DYNAMIC_HID_FIRST_REPORT_ID;
+	if (reportId < DYNAMIC_HID_FIRST_REPORT_ID || index >= DYNAMIC_HID_TRACKED_REPORT_IDS || (reportIdsUsed & (1UL << index))) {
+		for (index = 0; index < DYNAMIC_HID_TRACKED_REPORT_IDS && (reportIdsUsed & (1UL << index)); index++);
+		if (index == DYNAMIC_HID_TRACKED_REPORT_IDS)
+			return 0;
+		reportId = DYNAMIC_HID_FIRST_REPORT_ID + index;
+	}
+	reportIdsUsed |= 1UL << index;
+	return reportId;
+}
+
+void DynamicHID_::AddReport(DynamicHIDReport* report)
+{
+	report->next = reportRoot;
+	reportRoot = report;
+	reportCount++;
+}
+
+int DynamicHID_::QueueReport(DynamicHIDReport* report)
+{
+	// a report still waiting is replaced by the newer state in place
+	report->pending = true;
+	SendReports();
+	return report->pending ? 0 : report->length;
+}
+
+int DynamicHID_::SendReports()
+{
+	// round-robin from the report after the last one sent, stops when the IN endpoint is busy
+	int sent = 0;
+	DynamicHIDReport* report = reportCursor;
+	for (uint8_t checked = 0; checked < reportCount; checked++) {
+		if (!report)
+			report = reportRoot;
+		if (report->pending) {
+			if (USB_SendSpace(PID_ENDPOINT_IN) < min(report->length, DYNAMIC_HID_IN_PACKET_SIZE)) {
+				DYNAMIC_HID_STAT(stats.inBusy++);
+				break;
+			}
+			report->pending = false;
+			if (USB_Send(PID_ENDPOINT_IN | TRANSFER_RELEASE, report->data, report->length) < 0)
+				DYNAMIC_HID_STAT(stats.inFailed++);
+			else
+				DYNAMIC_HID_STAT(stats.inSent++);
+			sent++;
 		}
-		current->next = node;
+		report = report->next;
 	}
-	descriptorSize += node->length;
-	descriptorSize += node->pid_length;
+	reportCursor = report;
+	return sent;
 }
 
 int DynamicHID_::SendReport(uint8_t id, const void* data, int len)
 {
-	uint8_t p[len + 1];
-	p[0] = id;
-	memcpy(&p[1], data, len);
-	return USB_Send(PID_ENDPOINT_IN | TRANSFER_RELEASE, p, len + 1);
+	// never waits: the report gets a buffer per report ID and is queued behind the busy endpoint,
+	// returns the bytes sent, 0 when it is still queued or -1 when it cannot be queued
+	if (len < 0 || len >= 0xFF)
+		return -1;
+	DynamicHIDReport* report;
+	for (report = reportRoot; report && report->data[0] != id; report = report->next);
+	if (!report) {
+		uint8_t* buffer = new uint8_t[len + 1];
+		if (!buffer)
+			return -1;
+		report = new DynamicHIDReport(buffer, len + 1);
+		if (!report) {
+			delete[] buffer;
+			return -1;
+		}
+		buffer[0] = id;
+		AddReport(report);
+	}
+	if (report->length != len + 1)
+		return -1;
+	memcpy(&report->data[1], data, len);
+	return QueueReport(report);
+}
+
+int DynamicHID_::SendPIDState()
+{
+	// sent straight from the handler state, skipped while the endpoint is busy and retried on the next call
+	if (!pidReportHandler.pidStateChanges)
+		return 0;
+	if (USB_SendSpace(PID_ENDPOINT_IN) < (int)sizeof(USB_FFBReport_PIDStatus_Input_Data_t)) {
+		DYNAMIC_HID_STAT(stats.inBusy++);
+		return 0;
+	}
+	uint8_t* report = pidReportHandler.getPIDStateChange(FFB_TIME_NOW());
+	if (report == NULL)
+		return 0;
+	int res = USB_Send(PID_ENDPOINT_IN | TRANSFER_RELEASE, report, sizeof(USB_FFBReport_PIDStatus_Input_Data_t));
+	if (res < 0)
+		DYNAMIC_HID_STAT(stats.inFailed++);
+	else
+		DYNAMIC_HID_STAT(stats.inSent++);
+	return res;
 }
 
 int DynamicHID_::RecvData(byte* data)
@@ -118,23 +251,60 @@ int DynamicHID_::RecvData(byte* data)
 
 void DynamicHID_::RecvfromUsb() 
 {
+	FFB_PROFILE_SCOPE(FFB_PROFILE_RECV);
+#if DYNAMIC_HID_STATS || FFB_LATENCY_STATS
+	uint32_t start = FFB_TIME_NOW();
+#endif
 	if (usb_Available() > 0) {
-		uint16_t len = USB_Recv(PID_ENDPOINT_OUT, &out_ffbdata, 64);
-		if (len >= 0) {
+		int len = USB_Recv(PID_ENDPOINT_OUT, &out_ffbdata, sizeof(out_ffbdata));
+		DYNAMIC_HID_STAT(stats.outReceived++);
+		if (len > 0) {
+#if FFB_LATENCY_STATS
+			pidReportHandler.StampLatency(start);
+#endif
 			pidReportHandler.UppackUsbData(out_ffbdata, len);
 		}
+		if (len <= 0 || out_ffbdata[0] == 0 || out_ffbdata[0] > PID_REPORT_ID_MAX)
+			DYNAMIC_HID_STAT(stats.outDropped++);
 	}
+	DYNAMIC_HID_STAT(StatTime(stats.maxRecvUs, start));
+}
+
+#if DYNAMIC_HID_STATS
+void DynamicHID_::ResetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.reportId = DYNAMIC_HID_STATS_REPORT_ID;
+	stats.version = DYNAMIC_HID_STATS_VERSION;
+}
+
+void DynamicHID_::StatTime(uint16_t& longest, uint32_t start)
+{
+	uint32_t elapsed = FFB_TIME_NOW() - start;
+	if (elapsed > 0xFFFF)
+		elapsed = 0xFFFF;
+	if (elapsed > longest)
+		longest = elapsed;
 }
+#endif
 
 bool DynamicHID_::GetReport(USBSetup& setup) {
 	uint8_t report_id = setup.wValueL;
 	uint8_t report_type = setup.wValueH;
 	if (report_type == DYNAMIC_HID_REPORT_TYPE_INPUT)
 	{
-		//        /* Create the next HID report to send to the host */
-		//        GetNextReport(0xFF, &JoystickReportData);
-		//        /* Write the report data to the control endpoint */
-		//        USB_SendControl(TRANSFER_RELEASE, &JoystickReportData, sizeof(JoystickReportData));
+		// the current state as last built by the owner of the report ID, nothing is rebuilt
+		if (report_id == 2)
+		{
+			USB_SendControl(TRANSFER_RELEASE, pidReportHandler.getPIDStatus(), min(sizeof(USB_FFBReport_PIDStatus_Input_Data_t), setup.wLength));
+			return (true);
+		}
+		for (DynamicHIDReport* report = reportRoot; report; report = report->next) {
+			if (report->data[0] == report_id) {
+				USB_SendControl(TRANSFER_RELEASE, report->data, min(report->length, setup.wLength));
+				return (true);
+			}
+		}
 	}
 	if (report_type == DYNAMIC_HID_REPORT_TYPE_OUTPUT) {}
 	if (report_type == DYNAMIC_HID_REPORT_TYPE_FEATURE) {
@@ -147,14 +317,24 @@ bool DynamicHID_::GetReport(USBSetup& setup) {
 		}
 		if (report_id == 7)
 		{
-			USB_FFBReport_PIDPool_Feature_Data_t ans;
-			ans.reportId = report_id;
-			ans.ramPoolSize = 0xffff;
-			ans.maxSimultaneousEffects = MAX_EFFECTS;
-			ans.memoryManagement = 3;
-			USB_SendControl(TRANSFER_RELEASE, &ans, sizeof(USB_FFBReport_PIDPool_Feature_Data_t));
+			USB_SendControl(TRANSFER_RELEASE, pidReportHandler.getPIDPool(), sizeof(USB_FFBReport_PIDPool_Feature_Data_t));
+			return (true);
+		}
+#if DYNAMIC_HID_STATS
+		if (report_id == DYNAMIC_HID_STATS_REPORT_ID)
+		{
+			USB_SendControl(TRANSFER_RELEASE, &stats, min(sizeof(stats), setup.wLength));
 			return (true);
 		}
+#if FFB_LATENCY_STATS
+		if (report_id == DYNAMIC_HID_LATENCY_REPORT_ID)
+		{
+			pidReportHandler.latency.reportId = DYNAMIC_HID_LATENCY_REPORT_ID;
+			USB_SendControl(TRANSFER_RELEASE, pidReportHandler.getLatency(), min(sizeof(FFBLatencyStats), setup.wLength));
+			return (true);
+		}
+#endif
+#endif
 	}
 	return (false);
 }
@@ -172,6 +352,24 @@ bool DynamicHID_::SetReport(USBSetup& setup) {
 			//disableFeatureReport();
 			return true;
 		}
+#if DYNAMIC_HID_STATS
+		if (report_id == DYNAMIC_HID_STATS_REPORT_ID)
+		{
+			DynamicHIDStats ignored;
+			USB_RecvControl(&ignored, min(sizeof(ignored), length));
+			ResetStats();
+			return (true);
+		}
+#if FFB_LATENCY_STATS
+		if (report_id == DYNAMIC_HID_LATENCY_REPORT_ID)
+		{
+			FFBLatencyStats ignored;
+			USB_RecvControl(&ignored, min(sizeof(ignored), length));
+			pidReportHandler.ResetLatency();
+			return (true);
+		}
+#endif
+#endif
 		if (report_id == 5)
 		{
 			USB_FFBReport_CreateNewEffect_Feature_Data_t ans;
@@ -202,15 +400,20 @@ bool DynamicHID_::setup(USBSetup& setup)
 	if (requestType == REQUEST_DEVICETOHOST_CLASS_INTERFACE)
 	{
 		if (request == DYNAMIC_HID_GET_REPORT) {
-			// TODO: DYNAMIC_HID_GetReport();
-			GetReport(setup);
-			return true;
+			DYNAMIC_HID_STAT(stats.getReport++);
+			// an unknown report is stalled rather than left without an answer
+			if (GetReport(setup))
+				return true;
+			DYNAMIC_HID_STAT(stats.stalledRequests++);
+			return false;
 		}
 		if (request == DYNAMIC_HID_GET_PROTOCOL) {
+			DYNAMIC_HID_STAT(stats.otherRequests++);
 			// TODO: Send8(protocol);
 			return true;
 		}
 		if (request == DYNAMIC_HID_GET_IDLE) {
+			DYNAMIC_HID_STAT(stats.otherRequests++);
 			// TODO: Send8(idle);
 		}
 	}
@@ -221,27 +424,43 @@ bool DynamicHID_::setup(USBSetup& setup)
 			// The USB Host tells us if we are in boot or report mode.
 			// This only works with a real boot compatible device.
 			protocol = setup.wValueL;
+			DYNAMIC_HID_STAT(stats.otherRequests++);
 			return true;
 		}
 		if (request == DYNAMIC_HID_SET_IDLE) {
 			idle = setup.wValueL;
+			DYNAMIC_HID_STAT(stats.otherRequests++);
 			return true;
 		}
 		if (request == DYNAMIC_HID_SET_REPORT)
 		{
+			DYNAMIC_HID_STAT(stats.setReport++);
 			SetReport(setup);
 			return true;
 		}
 	}
+	DYNAMIC_HID_STAT(stats.stalledRequests++);
 	return false;
 }
 
 DynamicHID_::DynamicHID_(void) : PluggableUSBModule(PID_ENPOINT_COUNT, 1, epType),
-                   rootNode(NULL), descriptorSize(0),
+                   rootNode(NULL), lastNode(NULL), pidNode(NULL),
+                   descriptorData(NULL), descriptorDataSize(0), descriptorSize(0), reportIdsUsed(0),
+                   reportRoot(NULL), reportCursor(NULL), reportCount(0),
                    protocol(DYNAMIC_HID_REPORT_PROTOCOL), idle(1)
 {
 	epType[0] = EP_TYPE_INTERRUPT_IN;
 	epType[1] = EP_TYPE_INTERRUPT_OUT;
+#if DYNAMIC_HID_STATS
+	// the vendor collection takes the last tracked report ID, Joystick_ instances never get it
+	static DynamicHIDSubDescriptor statsNode(statsReportDescriptor, sizeof(statsReportDescriptor), NULL, 0, true);
+	AppendDescriptor(&statsNode);
+	reportIdsUsed |= 1UL << (DYNAMIC_HID_STATS_REPORT_ID - DYNAMIC_HID_FIRST_REPORT_ID);
+#if FFB_LATENCY_STATS
+	reportIdsUsed |= 1UL << (DYNAMIC_HID_LATENCY_REPORT_ID - DYNAMIC_HID_FIRST_REPORT_ID);
+#endif
+	ResetStats();
+#endif
 	PluggableUSB().plug(this);
 }
 
@@ -77,6 +77,45 @@
 
 #define PID_ENPOINT_COUNT 2
 
+// joystick input reports are numbered after the PID reports so no report ID has two meanings
+#define DYNAMIC_HID_FIRST_REPORT_ID (PID_REPORT_ID_MAX + 1)
+#define DYNAMIC_HID_TRACKED_REPORT_IDS 32
+
+// Interrupt endpoint polling period in microseconds, per direction. Full speed polls in 1 ms
+// frames; define DYNAMIC_HID_HIGH_SPEED 1 when the core enumerates at high speed (SAM/Due)
+// to poll in 125 us microframes, e.g. DYNAMIC_HID_IN_INTERVAL_US=125 for 8 kHz.
+#ifndef DYNAMIC_HID_HIGH_SPEED
+#define DYNAMIC_HID_HIGH_SPEED 0
+#endif
+#ifndef DYNAMIC_HID_IN_INTERVAL_US
+#define DYNAMIC_HID_IN_INTERVAL_US 1000
+#endif
+#ifndef DYNAMIC_HID_OUT_INTERVAL_US
+#define DYNAMIC_HID_OUT_INTERVAL_US 1000
+#endif
+
+// wMaxPacketSize per direction, up to USB_EP_SIZE; IN must hold the largest joystick report
+#ifndef DYNAMIC_HID_IN_PACKET_SIZE
+#define DYNAMIC_HID_IN_PACKET_SIZE USB_EP_SIZE
+#endif
+#ifndef DYNAMIC_HID_OUT_PACKET_SIZE
+#define DYNAMIC_HID_OUT_PACKET_SIZE USB_EP_SIZE
+#endif
+
+// USB counters, read through the vendor feature report DYNAMIC_HID_STATS_REPORT_ID with
+// extras/ffb_stats.py, a SET_REPORT to it clears them. Compiled out unless -DDYNAMIC_HID_STATS=1.
+#ifndef DYNAMIC_HID_STATS
+#define DYNAMIC_HID_STATS 0
+#endif
+#define DYNAMIC_HID_STATS_REPORT_ID (DYNAMIC_HID_FIRST_REPORT_ID + DYNAMIC_HID_TRACKED_REPORT_IDS - 1)
+#define DYNAMIC_HID_STATS_VERSION 1
+#define DYNAMIC_HID_LATENCY_REPORT_ID (DYNAMIC_HID_STATS_REPORT_ID - 1) // with FFB_LATENCY_STATS too
+#if DYNAMIC_HID_STATS
+#define DYNAMIC_HID_STAT(statement) do { statement; } while (0)
+#else
+#define DYNAMIC_HID_STAT(statement) do { } while (0)
+#endif
+
 #define PID_ENDPOINT_IN	 (pluggedEndpoint)
 #define PID_ENDPOINT_OUT (pluggedEndpoint+1)
 
@@ -93,6 +132,23 @@ typedef struct
   uint8_t descLenH;
 } DYNAMIC_HIDDescDescriptor;
 
+typedef struct
+{
+  uint8_t reportId;   // DYNAMIC_HID_STATS_REPORT_ID
+  uint8_t version;    // DYNAMIC_HID_STATS_VERSION
+  uint16_t maxRecvUs; // longest RecvfromUsb
+  uint16_t maxForceUs; // longest Joystick_::getForce
+  uint16_t stalledRequests; // control requests answered with a stall
+  uint32_t inSent;    // input reports handed to the IN endpoint
+  uint32_t inBusy;    // input reports put off while the IN endpoint was full
+  uint32_t inFailed;  // USB_Send errors
+  uint32_t outReceived; // OUT packets read
+  uint32_t outDropped;  // OUT packets empty or with an unknown report ID
+  uint32_t getReport;
+  uint32_t setReport;
+  uint32_t otherRequests; // protocol and idle requests
+} DynamicHIDStats;
+
 typedef struct 
 {
   InterfaceDescriptor hid;
@@ -113,6 +169,17 @@ public:
   const bool inProgMem;
 };
 
+// The current input report of one instance or report ID, sent by DynamicHID_::SendReports.
+class DynamicHIDReport {
+public:
+  DynamicHIDReport *next = NULL;
+  DynamicHIDReport(uint8_t* d, const uint8_t l) : data(d), length(l), pending(false) { }
+
+  uint8_t* data; // report ID, then the report
+  const uint8_t length; // including the report ID
+  volatile bool pending;
+};
+
 class DynamicHID_ : public PluggableUSBModule
 {
 public:
@@ -120,10 +187,21 @@ public:
   int begin(void);
   bool usb_Available();
   int SendReport(uint8_t id, const void* data, int len);
+  int SendPIDState();
   int RecvData(byte* data);
   void RecvfromUsb();
   void AppendDescriptor(DynamicHIDSubDescriptor* node);
+  uint8_t AllocateReportId(uint8_t reportId);
+  void AddReport(DynamicHIDReport* report);
+  int QueueReport(DynamicHIDReport* report);
+  int SendReports();
   PIDReportHandler pidReportHandler;
+#if DYNAMIC_HID_STATS
+  DynamicHIDStats stats;
+  void ResetStats();
+  // keeps the longest time since start, in microseconds
+  static void StatTime(uint16_t& longest, uint32_t start);
+#endif
 
 protected:
   // Implementation of the PluggableUSBModule
@@ -136,9 +214,17 @@ protected:
 
 private:
   uint8_t epType[2];
-  uint8_t out_ffbdata[64];
+  uint8_t out_ffbdata[DYNAMIC_HID_OUT_PACKET_SIZE];
   DynamicHIDSubDescriptor* rootNode;
+  DynamicHIDSubDescriptor* lastNode;
+  DynamicHIDSubDescriptor* pidNode; // the only node whose PID descriptor is sent
+  uint8_t* descriptorData; // the instance descriptors back to back, PID block excluded
+  uint16_t descriptorDataSize;
   uint16_t descriptorSize;
+  uint32_t reportIdsUsed; // bit per report ID from DYNAMIC_HID_FIRST_REPORT_ID
+  DynamicHIDReport* reportRoot;
+  DynamicHIDReport* reportCursor; // next report in the round-robin
+  uint8_t reportCount;
 
   uint8_t protocol;
   uint8_t idle;
@@ -149,6 +235,13 @@ private:
 // https://isocpp.org/wiki/faq/ctors#static-init-order-on-first-use
 DynamicHID_& DynamicHID();
 
+// bInterval for a polling period: frames at full speed, 2^(bInterval-1) microframes at high speed
+constexpr uint8_t DynamicHIDInterval(uint32_t us, uint8_t n = 1)
+{
+  return DYNAMIC_HID_HIGH_SPEED ? ((n >= 16 || (125UL << n) > us) ? n : DynamicHIDInterval(us, n + 1))
+                                : (us < 1000 ? 1 : (us >= 255000UL ? 255 : us / 1000));
+}
+
 #define D_HIDREPORT(length) { 9, 0x21, 0x11, 0x01, 0, 1, 0x22, lowByte(length), highByte(length) }
 
 #endif // USBCON
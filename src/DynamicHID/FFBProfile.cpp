@@ -0,0 +1,60 @@
+#include "FFBProfile.h"
+#include "PIDReportHandler.h" // FFB_CRITICAL_BEGIN
+
+#if FFB_PROFILE
+FFBProfileEntry ffbProfile[FFB_PROFILE_SITES];
+
+static const char ffbProfileNames[FFB_PROFILE_SITES][16] PROGMEM = {
+	"force", "constant", "ramp", "square", "sine", "triangle", "sawtoothDown", "sawtoothUp",
+	"custom", "condition", "sendState", "build16Bit", "unpackUsbData", "recvfromUsb"
+};
+
+// an entry without samples takes the first one as its minimum
+void FFBProfileAdd(uint8_t site, uint32_t ticks)
+{
+	FFBProfileEntry& entry = ffbProfile[site];
+	if (ticks < entry.minTicks || entry.count == 0)
+		entry.minTicks = ticks;
+	if (ticks > entry.maxTicks)
+		entry.maxTicks = ticks;
+	if (entry.totalTicks + ticks < entry.totalTicks) {
+		entry.totalTicks >>= 1;
+		entry.count >>= 1;
+	}
+	entry.totalTicks += ticks;
+	entry.count++;
+}
+
+void FFBProfileReset()
+{
+#ifdef FFB_PROFILE_DWT
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	FFB_CRITICAL_BEGIN();
+	memset(ffbProfile, 0, sizeof(ffbProfile));
+	FFB_CRITICAL_END();
+}
+
+void FFBProfilePrint(Print& out)
+{
+	for (uint8_t site = 0; site < FFB_PROFILE_SITES; site++) {
+		// copied with interrupts off, RecvfromUsb updates its sites from the ISR
+		FFB_CRITICAL_BEGIN();
+		FFBProfileEntry entry = ffbProfile[site];
+		FFB_CRITICAL_END();
+		if (!entry.count)
+			continue;
+		out.print((const __FlashStringHelper*)ffbProfileNames[site]);
+		out.print(F(" n="));
+		out.print(entry.count);
+		out.print(F(" min="));
+		out.print(entry.minTicks);
+		out.print(F(" avg="));
+		out.print(entry.totalTicks / entry.count);
+		out.print(F(" max="));
+		out.print(entry.maxTicks);
+		out.println(F(" " FFB_PROFILE_UNIT));
+	}
+}
+#endif
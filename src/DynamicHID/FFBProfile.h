@@ -0,0 +1,86 @@
+#ifndef _FFBPROFILE_H
+#define _FFBPROFILE_H
+#include <Arduino.h>
+
+// Scoped run time profiling of the force feedback path, compiled out unless -DFFB_PROFILE=1.
+// FFB_PROFILE_SCOPE(site) at the top of a function adds its run time to ffbProfile[site],
+// FFBProfilePrint(Serial) prints count/min/avg/max per site. Times include nested sites.
+#ifndef FFB_PROFILE
+#define FFB_PROFILE 0
+#endif
+
+// free-running timer of the profiler, define FFB_PROFILE_NOW() and FFB_PROFILE_UNIT for a finer one
+#ifndef FFB_PROFILE_NOW
+#if defined(__AVR__)
+#define FFB_PROFILE_NOW() micros() // timer 0, 4 us steps at 16 MHz
+#define FFB_PROFILE_UNIT "us"
+#elif defined(ARDUINO_ARCH_SAM)
+#define FFB_PROFILE_NOW() DWT->CYCCNT // core cycles, enabled by FFBProfileReset()
+#define FFB_PROFILE_UNIT "cycles"
+#define FFB_PROFILE_DWT
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define FFB_PROFILE_NOW() ((uint32_t)__rdtsc())
+#define FFB_PROFILE_UNIT "tsc"
+#else
+#include <time.h>
+static inline uint32_t FFBProfileClock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+#define FFB_PROFILE_NOW() FFBProfileClock()
+#define FFB_PROFILE_UNIT "ns"
+#endif
+#endif
+#ifndef FFB_PROFILE_UNIT
+#define FFB_PROFILE_UNIT "ticks"
+#endif
+
+enum FFBProfileSite {
+	FFB_PROFILE_FORCE,
+	FFB_PROFILE_CONSTANT,
+	FFB_PROFILE_RAMP,
+	FFB_PROFILE_SQUARE,
+	FFB_PROFILE_SINE,
+	FFB_PROFILE_TRIANGLE,
+	FFB_PROFILE_SAWTOOTH_DOWN,
+	FFB_PROFILE_SAWTOOTH_UP,
+	FFB_PROFILE_CUSTOM,
+	FFB_PROFILE_CONDITION,
+	FFB_PROFILE_SEND_STATE,
+	FFB_PROFILE_BUILD_16BIT,
+	FFB_PROFILE_UNPACK,
+	FFB_PROFILE_RECV,
+	FFB_PROFILE_SITES
+};
+
+#if FFB_PROFILE
+typedef struct {
+	uint32_t minTicks, maxTicks;
+	uint32_t count, totalTicks; // halve together before totalTicks overflows
+} FFBProfileEntry;
+
+extern FFBProfileEntry ffbProfile[FFB_PROFILE_SITES];
+
+void FFBProfileAdd(uint8_t site, uint32_t ticks);
+void FFBProfileReset();
+void FFBProfilePrint(Print& out);
+
+class FFBProfileScope {
+public:
+	FFBProfileScope(uint8_t s) : site(s), start(FFB_PROFILE_NOW()) { }
+	~FFBProfileScope() { FFBProfileAdd(site, FFB_PROFILE_NOW() - start); }
+
+private:
+	uint8_t site;
+	uint32_t start;
+};
+
+#define FFB_PROFILE_SCOPE(site) FFBProfileScope ffbProfileScope(site)
+#else
+#define FFB_PROFILE_SCOPE(site) do { } while (0)
+#endif
+
+#endif
@@ -1,9 +1,86 @@
 #include "PIDReportHandler.h"
 
+static_assert(FFB_CONDITION_BLOCKS >= MAX_FFB_AXIS_COUNT && FFB_ENVELOPE_BLOCKS >= 1 && FFB_PERIODIC_BLOCKS >= 1, "parameter block pools too small for one effect");
+static_assert(FFB_CONDITION_BLOCKS < SHARED_BLOCK_FULL && FFB_ENVELOPE_BLOCKS < SHARED_BLOCK_FULL && FFB_PERIODIC_BLOCKS < SHARED_BLOCK_FULL, "block index is 8-bit");
+
+// the index of an identical block or of one that now holds the block, 0 for an all-zero block,
+// SHARED_BLOCK_FULL when the pool has no room; the caller gets a reference and releases current,
+// which is rewritten in place when nothing else uses it
+template <typename T>
+static uint8_t ShareBlock(volatile T* blocks, volatile uint8_t* refs, uint8_t count, uint8_t current, const T& block)
+{
+	static const T zero = {};
+	if (memcmp(&block, &zero, sizeof(T)) == 0)
+		return 0;
+	uint8_t free = SHARED_BLOCK_FULL;
+	for (uint8_t i = 1; i < count; i++) {
+		if (refs[i] == 0) {
+			if (free == SHARED_BLOCK_FULL)
+				free = i;
+		}
+		else if (memcmp((const void*)&blocks[i], &block, sizeof(T)) == 0) {
+			refs[i]++;
+			return i;
+		}
+	}
+	if (current != 0 && refs[current] == 1)
+		free = current;
+	if (free != SHARED_BLOCK_FULL) {
+		memcpy((void*)&blocks[free], &block, sizeof(T));
+		refs[free]++;
+	}
+	return free;
+}
+
+// bit of a trigger button in the first button byte, 0 for no or an out of range button
+static inline uint8_t TriggerMask(uint8_t button)
+{
+	return (button >= 1 && button <= 8) ? (uint8_t)(1UL << (button - 1)) : 0;
+}
+
+// unused blocks of a pool, block 0 is not counted
+static uint8_t FreeBlocks(volatile uint8_t* refs, uint8_t count)
+{
+	uint8_t free = 0;
+	for (uint8_t i = 1; i < count; i++) {
+		if (refs[i] == 0)
+			free++;
+	}
+	return free;
+}
+
+static inline void ReleaseBlock(volatile uint8_t* refs, uint8_t index)
+{
+	if (index != 0 && refs[index] != 0)
+		refs[index]--;
+}
+
 PIDReportHandler::PIDReportHandler() 
 {
 	nextEID = 1;
 	devicePaused = 0;
+	deviceGain.gain = 255;
+	customForceBlocksUsed = 0;
+	downloadEffect = 0;
+	downloadOffset = 0;
+	activeEffects = 0;
+	memset((void*)timerWheel, 0, sizeof(timerWheel));
+	timerSlot = 0;
+	armedEffects = 0;
+	triggerButtons = 0;
+	blockPoolFull = 0;
+	memset((void*)shadowOwner, 0, sizeof(shadowOwner));
+	shadowCommitting = 0xFF;
+	memset((void*)envelopeBlocks, 0, sizeof(envelopeBlocks));
+	memset((void*)conditionBlocks, 0, sizeof(conditionBlocks));
+	memset((void*)periodicBlocks, 0, sizeof(periodicBlocks));
+	ClearBlocks();
+	pidStateChanges = 0;
+	pidStateSentUs = 0;
+#if FFB_LATENCY_STATS
+	latencyStamped = 0;
+	ResetLatency();
+#endif
 }
 
 PIDReportHandler::~PIDReportHandler() 
@@ -13,21 +90,18 @@ PIDReportHandler::~PIDReportHandler()
 
 uint8_t PIDReportHandler::GetNextFreeEffect(void)
 {
-	if (nextEID == MAX_EFFECTS)
+	// nextEID is the lowest id that may be free, FreeEffect moves it back;
+	// no new effect while a parameter update waits for a free block
+	if (blockPoolFull)
 		return 0;
-
-	uint8_t id = nextEID++;
-
-	while (g_EffectStates[nextEID].state != 0)
-	{
-		if (nextEID >= MAX_EFFECTS)
-			break;  // the last spot was taken
-		nextEID++;
+	for (uint8_t id = max(nextEID, 1); id <= MAX_EFFECTS; id++) {
+		if (g_EffectStates[id].state == MEFFECTSTATE_FREE) {
+			g_EffectStates[id].state = MEFFECTSTATE_ALLOCATED;
+			nextEID = id + 1;
+			return id;
+		}
 	}
-
-	g_EffectStates[id].state = MEFFECTSTATE_ALLOCATED;
-
-	return id;
+	return 0;
 }
 
 void PIDReportHandler::StopAllEffects(void)
@@ -38,44 +112,488 @@ void PIDReportHandler::StopAllEffects(void)
 
 void PIDReportHandler::StartEffect(uint8_t id)
 {
-	if (id > MAX_EFFECTS)
+	if (id == 0 || id > MAX_EFFECTS)
 		return;
-	g_EffectStates[id].state = MEFFECTSTATE_PLAYING;
-	g_EffectStates[id].elapsedTime = 0;
-	g_EffectStates[id].startTime = (uint64_t)millis();
+	volatile TEffectState* effect = &g_EffectStates[id];
+	volatile TEffectParameters* params = PendingEffect(id);
+	FFB_CRITICAL_BEGIN();
+	if (!(effect->state & MEFFECTSTATE_PLAYING)) {
+		effect->nextActive = activeEffects;
+		activeEffects = id;
+		EffectStateChanged(id);
+	}
+	effect->state = (effect->state & ~MEFFECTSTATE_DELAYED) | MEFFECTSTATE_PLAYING;
+	effect->elapsedUs = 0;
+	effect->phaseAccumulator = 0;
+	effect->startUs = FFB_TIME_NOW();
+	// the earlier of the end of the effect and its trigger repeat
+	uint32_t due = params->durationUs;
+	if ((effect->state & MEFFECTSTATE_ARMED) && params->triggerRepeatInterval)
+		due = min(due, (uint32_t)params->triggerRepeatInterval * 1000);
+	if (due != FFB_TIME_INFINITE)
+		AddTimer(id, effect->startUs + due);
+	else
+		CancelTimer(id);
+	FFB_CRITICAL_END();
 }
 
 void PIDReportHandler::StopEffect(uint8_t id)
 {
 	if (id > MAX_EFFECTS)
 		return;
-	g_EffectStates[id].state &= ~MEFFECTSTATE_PLAYING;
-	pidBlockLoad.ramPoolAvailable += SIZE_EFFECT;
+	EndEffect(id);
+	g_EffectStates[id].state &= ~(MEFFECTSTATE_DELAYED | MEFFECTSTATE_ARMED);
+	armedEffects &= ~(1UL << id);
+}
+
+void PIDReportHandler::ArmEffect(uint8_t id)
+{
+	if (id == 0 || id > MAX_EFFECTS)
+		return;
+	volatile TEffectParameters* params = PendingEffect(id);
+	if (TriggerMask(params->triggerButton)) {
+		// plays when the trigger button is pressed, see RunScheduler
+		g_EffectStates[id].state |= MEFFECTSTATE_ARMED;
+		armedEffects |= 1UL << id;
+	}
+	else {
+		BeginEffect(id);
+	}
+}
+
+void PIDReportHandler::BeginEffect(uint8_t id)
+{
+	if (id == 0 || id > MAX_EFFECTS)
+		return;
+	uint16_t startDelay = PendingEffect(id)->startDelay;
+	if (startDelay) {
+		FFB_CRITICAL_BEGIN();
+		g_EffectStates[id].state |= MEFFECTSTATE_DELAYED;
+		AddTimer(id, FFB_TIME_NOW() + (uint32_t)startDelay * 1000);
+		FFB_CRITICAL_END();
+	}
+	else {
+		StartEffect(id);
+	}
+}
+
+void PIDReportHandler::EndEffect(uint8_t id)
+{
+	volatile TEffectState* effect = &g_EffectStates[id];
+	FFB_CRITICAL_BEGIN();
+	CancelTimer(id);
+	if (effect->state & MEFFECTSTATE_PLAYING) {
+		// the unlinked effect keeps nextActive so a force tick walking the list can continue
+		volatile uint8_t* link = &activeEffects;
+		while (*link && *link != id)
+			link = &g_EffectStates[*link].nextActive;
+		if (*link)
+			*link = effect->nextActive;
+		effect->state &= ~MEFFECTSTATE_PLAYING;
+		EffectStateChanged(id);
+	}
+	FFB_CRITICAL_END();
 }
 
 void PIDReportHandler::FreeEffect(uint8_t id)
 {
 	if (id > MAX_EFFECTS)
 		return;
+	FreeCustomForce(&g_EffectStates[id]);
+	EndEffect(id);
+	ReleaseBlocks(&g_EffectStates[id]);
+	DropShadows(id);
+	armedEffects &= ~(1UL << id);
+	blockPoolFull = 0;
+	if (id == downloadEffect)
+		downloadEffect = 0;
 	g_EffectStates[id].state = 0;
 	if (id < nextEID)
 		nextEID = id;
+	pidBlockLoad.ramPoolAvailable = GetPoolAvailable();
 }
 
 void PIDReportHandler::FreeAllEffects(void)
 {
 	nextEID = 1;
 	memset((void*)& g_EffectStates, 0, sizeof(g_EffectStates));
+	customForceBlocksUsed = 0;
+	downloadEffect = 0;
+	activeEffects = 0;
+	memset((void*)timerWheel, 0, sizeof(timerWheel));
+	armedEffects = 0;
+	memset((void*)shadowOwner, 0, sizeof(shadowOwner));
+	ClearBlocks();
+	blockPoolFull = 0;
+	pidStateChanges = 1; // nothing plays any more
 	pidBlockLoad.ramPoolAvailable = MEMORY_SIZE;
 }
 
+uint16_t PIDReportHandler::GetPoolAvailable(void)
+{
+	// counted from the allocators, free effect, parameter and custom force blocks
+	uint16_t available = 0;
+	for (uint8_t id = 1; id <= MAX_EFFECTS; id++) {
+		if (g_EffectStates[id].state == MEFFECTSTATE_FREE)
+			available += SIZE_EFFECT;
+	}
+	available += FreeBlocks(envelopeRefs, FFB_ENVELOPE_BLOCKS + 1) * sizeof(TEffectEnvelope);
+	available += FreeBlocks(conditionRefs, FFB_CONDITION_BLOCKS + 1) * sizeof(TEffectCondition);
+	available += FreeBlocks(periodicRefs, FFB_PERIODIC_BLOCKS + 1) * sizeof(TEffectPeriodic);
+	for (uint8_t block = 0; block < CUSTOM_FORCE_POOL_BLOCKS; block++) {
+		if (!(customForceBlocksUsed & (1UL << block)))
+			available += CUSTOM_FORCE_BLOCK_SIZE;
+	}
+	return available;
+}
+
+void PIDReportHandler::EffectStateChanged(uint8_t id)
+{
+	// reported from the main loop by DynamicHID_::SendPIDState
+	pidStateChanges |= 1UL << id;
+}
+
+bool PIDReportHandler::EffectAllocated(uint8_t id)
+{
+	// parameter blocks are only taken by created effects
+	return id != 0 && id <= MAX_EFFECTS && g_EffectStates[id].state != MEFFECTSTATE_FREE;
+}
+
+void PIDReportHandler::BlockPoolFull(void)
+{
+	// the update is dropped, the host sees Full in the Block Load report and on its next Create New Effect
+	blockPoolFull = 1;
+	pidBlockLoad.loadStatus = 2;
+	pidBlockLoad.ramPoolAvailable = GetPoolAvailable();
+}
+
+volatile TEffectParameters* PIDReportHandler::EffectForWrite(uint8_t id)
+{
+	if (id == 0 || id > MAX_EFFECTS)
+		return &g_EffectStates[0]; // never played
+	// reuse the open shadow of the effect, the one being committed is read only
+	volatile TEffectParameters* source = &g_EffectStates[id];
+	uint8_t free = 0xFF;
+	for (uint8_t i = 0; i < FFB_SHADOW_EFFECTS; i++) {
+		if (i == shadowCommitting) {
+			if (shadowOwner[i] == id)
+				source = &shadowEffects[i];
+		}
+		else if (shadowOwner[i] == id) {
+			return &shadowEffects[i];
+		}
+		else if (shadowOwner[i] == 0 && free == 0xFF) {
+			free = i;
+		}
+	}
+	if (free == 0xFF) {
+		g_EffectStates[id].scaleValid = 0; // all shadows busy, written in place without a commit
+		return &g_EffectStates[id];
+	}
+	memcpy((void*)&shadowEffects[free], (const void*)source, EFFECT_PARAMETERS_SIZE);
+	ShareBlocks(&shadowEffects[free], source);
+	shadowOwner[free] = id;
+	return &shadowEffects[free];
+}
+
+volatile TEffectParameters* PIDReportHandler::PendingEffect(uint8_t id)
+{
+	// the newest parameters of the effect, committed or not
+	if (id == 0 || id > MAX_EFFECTS)
+		return &g_EffectStates[0];
+	volatile TEffectParameters* pending = &g_EffectStates[id];
+	for (uint8_t i = 0; i < FFB_SHADOW_EFFECTS; i++) {
+		if (shadowOwner[i] == id) {
+			pending = &shadowEffects[i];
+			if (i != shadowCommitting)
+				break;
+		}
+	}
+	return pending;
+}
+
+void PIDReportHandler::DropShadows(uint8_t id)
+{
+	for (uint8_t i = 0; i < FFB_SHADOW_EFFECTS; i++) {
+		if (shadowOwner[i] == id) {
+			shadowOwner[i] = 0;
+			if (i != shadowCommitting)
+				ReleaseBlocks(&shadowEffects[i]); // otherwise released by CommitEffects
+		}
+	}
+}
+
+void PIDReportHandler::CommitEffects(void)
+{
+	// force tick only, the flag keeps the handler from writing or reusing the shadow during the copy
+	for (uint8_t i = 0; i < FFB_SHADOW_EFFECTS; i++) {
+		shadowCommitting = i;
+		uint8_t id = shadowOwner[i];
+		if (id != 0) {
+			volatile TEffectState* effect = &g_EffectStates[id];
+			memcpy((void*)(volatile TEffectParameters*)effect, (const void*)&shadowEffects[i], EFFECT_PARAMETERS_SIZE);
+			// the block references move over in one step, a shadow dropped meanwhile only lets go of its own
+			FFB_CRITICAL_BEGIN();
+			if (shadowOwner[i] == id) {
+				ReleaseBlocks(effect);
+				ShareBlocks(effect, &shadowEffects[i]);
+				shadowOwner[i] = 0;
+			}
+			ReleaseBlocks(&shadowEffects[i]);
+			FFB_CRITICAL_END();
+			// the float scale is only recomputed when gain, direction, axes or condition blocks changed
+			if (effect->scaleDirty) {
+				effect->scaleDirty = 0;
+				effect->scaleValid = 0;
+			}
+		}
+	}
+	shadowCommitting = 0xFF;
+}
+
+void PIDReportHandler::ShareBlocks(volatile TEffectParameters* effect, volatile TEffectParameters* from)
+{
+	// the effect takes its own references to the parameter blocks of from
+	effect->envelopeBlock = from->envelopeBlock;
+	effect->periodicBlock = from->periodicBlock;
+	if (effect->envelopeBlock) envelopeRefs[effect->envelopeBlock]++;
+	if (effect->periodicBlock) periodicRefs[effect->periodicBlock]++;
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+		effect->conditionBlock[axis] = from->conditionBlock[axis];
+		if (effect->conditionBlock[axis]) conditionRefs[effect->conditionBlock[axis]]++;
+	}
+}
+
+void PIDReportHandler::ReleaseBlocks(volatile TEffectParameters* effect)
+{
+	ReleaseBlock(envelopeRefs, effect->envelopeBlock);
+	ReleaseBlock(periodicRefs, effect->periodicBlock);
+	effect->envelopeBlock = 0;
+	effect->periodicBlock = 0;
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+		ReleaseBlock(conditionRefs, effect->conditionBlock[axis]);
+		effect->conditionBlock[axis] = 0;
+	}
+}
+
+void PIDReportHandler::ClearBlocks(void)
+{
+	memset((void*)envelopeRefs, 0, sizeof(envelopeRefs));
+	memset((void*)conditionRefs, 0, sizeof(conditionRefs));
+	memset((void*)periodicRefs, 0, sizeof(periodicRefs));
+	// a shadow being committed keeps its blocks until CommitEffects lets go of them
+	if (shadowCommitting < FFB_SHADOW_EFFECTS) {
+		volatile TEffectParameters* shadow = &shadowEffects[shadowCommitting];
+		ShareBlocks(shadow, shadow);
+	}
+}
+
+void PIDReportHandler::UpdateDuration(volatile TEffectParameters* effect, uint8_t loopCount)
+{
+	// loopCount 0xFF repeats until stopped, 0 plays once
+	uint32_t durationUs = (uint32_t)effect->duration * 1000;
+	uint8_t loops = max(loopCount, 1);
+	if (effect->duration == USB_DURATION_INFINITE || loopCount == 0xFF)
+		effect->durationUs = FFB_TIME_INFINITE;
+	else if (durationUs && loops > FFB_TIME_MAX / durationUs)
+		effect->durationUs = FFB_TIME_MAX;
+	else
+		effect->durationUs = durationUs * loops;
+	effect->rampStep = effect->durationUs ? 0xFFFFFFFFUL / effect->durationUs : 0xFFFFFFFFUL;
+}
+
+void PIDReportHandler::UpdateEnvelope(volatile TEffectParameters* effect)
+{
+	// the envelope levels are relative to the magnitude of the effect type
+	uint16_t magnitude;
+	switch (effect->effectType) {
+	case USB_EFFECT_CONSTANT:
+		magnitude = abs(effect->magnitude);
+		break;
+	case USB_EFFECT_RAMP:
+		magnitude = max(abs(effect->startMagnitude), abs(effect->endMagnitude));
+		break;
+	case USB_EFFECT_SQUARE:
+	case USB_EFFECT_SINE:
+	case USB_EFFECT_TRIANGLE:
+	case USB_EFFECT_SAWTOOTHDOWN:
+	case USB_EFFECT_SAWTOOTHUP:
+		magnitude = periodicBlocks[effect->periodicBlock].magnitude;
+		break;
+	default:
+		magnitude = effect->magnitude;
+		break;
+	}
+	volatile TEffectEnvelope& envelope = envelopeBlocks[effect->envelopeBlock];
+	if (magnitude == 0 || (envelope.attackTime == 0 && envelope.fadeTime == 0)) {
+		effect->hasEnvelope = 0;
+		return;
+	}
+
+	effect->attackScale = min(0xFFFFUL, ((uint32_t)envelope.attackLevel << ENVELOPE_SCALE_SHIFT) / magnitude);
+	effect->fadeScale = min(0xFFFFUL, ((uint32_t)envelope.fadeLevel << ENVELOPE_SCALE_SHIFT) / magnitude);
+	uint32_t fadeTimeUs = (uint32_t)envelope.fadeTime * 1000;
+	effect->attackTimeUs = (uint32_t)envelope.attackTime * 1000;
+	effect->attackStep = effect->attackTimeUs ? 0xFFFFFFFFUL / effect->attackTimeUs : 0;
+	effect->fadeStep = fadeTimeUs ? 0xFFFFFFFFUL / fadeTimeUs : 0;
+	if (fadeTimeUs == 0 || effect->durationUs == FFB_TIME_INFINITE)
+		effect->fadeStartUs = FFB_TIME_INFINITE;
+	else
+		effect->fadeStartUs = effect->durationUs > fadeTimeUs ? effect->durationUs - fadeTimeUs : 0;
+	effect->hasEnvelope = 1;
+}
+
+bool PIDReportHandler::AllocateCustomForce(volatile TEffectState* effect, uint16_t samples)
+{
+	uint16_t blocks = (samples + CUSTOM_FORCE_BLOCK_SIZE - 1) / CUSTOM_FORCE_BLOCK_SIZE;
+	if (blocks <= effect->customBlockCount)
+		return true;
+	if (blocks > CUSTOM_FORCE_POOL_BLOCKS)
+		return false;
+
+	// first fit of contiguous free blocks, the old buffer stays reserved while searching
+	uint32_t mask = 0xFFFFFFFFUL >> (32 - blocks);
+	for (uint8_t first = 0; first + blocks <= CUSTOM_FORCE_POOL_BLOCKS; first++) {
+		if (customForceBlocksUsed & (mask << first))
+			continue;
+		int8_t* samplesTo = (int8_t*)&customForcePool[first * CUSTOM_FORCE_BLOCK_SIZE];
+		memset(samplesTo, 0, blocks * CUSTOM_FORCE_BLOCK_SIZE);
+		if (effect->customBlockCount) {
+			memcpy(samplesTo, (int8_t*)&customForcePool[effect->customBlock * CUSTOM_FORCE_BLOCK_SIZE],
+				effect->customBlockCount * CUSTOM_FORCE_BLOCK_SIZE);
+			FreeCustomForce(effect);
+		}
+		customForceBlocksUsed |= mask << first;
+		effect->customBlock = first;
+		effect->customBlockCount = blocks;
+		return true;
+	}
+	return false;
+}
+
+void PIDReportHandler::FreeCustomForce(volatile TEffectState* effect)
+{
+	if (effect->customBlockCount == 0)
+		return;
+	customForceBlocksUsed &= ~((0xFFFFFFFFUL >> (32 - effect->customBlockCount)) << effect->customBlock);
+	effect->customBlockCount = 0;
+}
+
+void PIDReportHandler::UpdateCustomForceStep(volatile TEffectParameters* effect)
+{
+	// the whole ring is one period of the phase accumulator
+	uint32_t period = (uint32_t)effect->sampleCount * effect->samplePeriod;
+	effect->phaseIncrement = period ? (0xFFFFFFFFUL / period + 500) / 1000 : 0;
+}
+
+void PIDReportHandler::AddTimer(uint8_t id, uint32_t due)
+{
+	volatile TEffectState* effect = &g_EffectStates[id];
+	CancelTimer(id);
+	// a timer already due goes to the slot processed next
+	uint32_t nextSlotTime = timerSlot << FFB_TIMER_SLOT_SHIFT;
+	if ((int32_t)(due - nextSlotTime) < 0)
+		due = nextSlotTime;
+	uint8_t slot = (due >> FFB_TIMER_SLOT_SHIFT) & (FFB_TIMER_SLOTS - 1);
+	effect->timerDue = due;
+	effect->nextTimer = timerWheel[slot];
+	effect->timerPending = 1;
+	timerWheel[slot] = id;
+}
+
+void PIDReportHandler::CancelTimer(uint8_t id)
+{
+	volatile TEffectState* effect = &g_EffectStates[id];
+	if (!effect->timerPending)
+		return;
+	volatile uint8_t* link = &timerWheel[(effect->timerDue >> FFB_TIMER_SLOT_SHIFT) & (FFB_TIMER_SLOTS - 1)];
+	while (*link && *link != id)
+		link = &g_EffectStates[*link].nextTimer;
+	if (*link)
+		*link = effect->nextTimer;
+	effect->timerPending = 0;
+}
+
+void PIDReportHandler::EffectTimer(uint8_t id, uint32_t now)
+{
+	volatile TEffectState* effect = &g_EffectStates[id];
+	volatile TEffectParameters* params = PendingEffect(id);
+	if (effect->state & MEFFECTSTATE_DELAYED) {
+		StartEffect(id);
+		return;
+	}
+	uint32_t elapsedUs = now - effect->startUs;
+	uint32_t repeatUs = (uint32_t)params->triggerRepeatInterval * 1000;
+	bool repeat = (effect->state & MEFFECTSTATE_ARMED) && repeatUs &&
+		(triggerButtons & TriggerMask(params->triggerButton));
+	if (repeat && elapsedUs >= repeatUs) {
+		StartEffect(id); // auto-repeat while the trigger button is held
+		return;
+	}
+	if (elapsedUs >= params->durationUs) {
+		EndEffect(id);
+		if (repeat)
+			AddTimer(id, effect->startUs + repeatUs);
+		return;
+	}
+	uint32_t due = params->durationUs;
+	if (repeat && elapsedUs < repeatUs)
+		due = min(due, repeatUs);
+	if (due != FFB_TIME_INFINITE)
+		AddTimer(id, effect->startUs + due);
+}
+
+void PIDReportHandler::RunScheduler(uint32_t now, uint8_t buttons)
+{
+	FFB_CRITICAL_BEGIN();
+	// a newly pressed trigger button starts its armed effects
+	uint8_t pressed = buttons & ~triggerButtons;
+	triggerButtons = buttons;
+	if (pressed && armedEffects) {
+		for (uint8_t id = 1; id <= MAX_EFFECTS; id++) {
+			if ((armedEffects & (1UL << id)) && (pressed & TriggerMask(PendingEffect(id)->triggerButton)) &&
+				!(g_EffectStates[id].state & (MEFFECTSTATE_PLAYING | MEFFECTSTATE_DELAYED)))
+				BeginEffect(id);
+		}
+	}
+
+	// fire the timers of every slot passed since the last tick, at most one lap
+	uint32_t nowSlot = now >> FFB_TIMER_SLOT_SHIFT;
+	uint32_t slot = nowSlot - timerSlot < FFB_TIMER_SLOTS ? timerSlot : nowSlot - (FFB_TIMER_SLOTS - 1);
+	for (;; slot++) {
+		volatile uint8_t* link = &timerWheel[slot & (FFB_TIMER_SLOTS - 1)];
+		while (*link) {
+			uint8_t id = *link;
+			volatile TEffectState* effect = &g_EffectStates[id];
+			if ((int32_t)(now - effect->timerDue) >= 0) {
+				*link = effect->nextTimer;
+				effect->timerPending = 0;
+				EffectTimer(id, now); // a new timer is due later and not met again this pass
+			}
+			else {
+				link = &effect->nextTimer; // a later lap
+			}
+		}
+		if (slot == nowSlot)
+			break;
+	}
+	timerSlot = nowSlot;
+	FFB_CRITICAL_END();
+}
+
+void PIDReportHandler::InvalidateForceScales(void)
+{
+	for (uint8_t id = 0; id <= MAX_EFFECTS; id++)
+		g_EffectStates[id].scaleValid = 0;
+}
+
 void PIDReportHandler::EffectOperation(USB_FFBReport_EffectOperation_Output_Data_t* data)
 {
 	if (data->operation == 1)
 	{ // Start
-		if (data->loopCount > 0) g_EffectStates[data->effectBlockIndex].duration *= data->loopCount;
-		if (data->loopCount == 0xFF) g_EffectStates[data->effectBlockIndex].duration = USB_DURATION_INFINITE;
-		StartEffect(data->effectBlockIndex);
+		UpdateDuration(EffectForWrite(data->effectBlockIndex), data->loopCount);
+		UpdateEnvelope(EffectForWrite(data->effectBlockIndex));
+		ArmEffect(data->effectBlockIndex);
 	}
 	else if (data->operation == 2)
 	{ // StartSolo
@@ -83,7 +601,9 @@ void PIDReportHandler::EffectOperation(USB_FFBReport_EffectOperation_Output_Data
 	  // Stop all first
 		StopAllEffects();
 		// Then start the given effect
-		StartEffect(data->effectBlockIndex);
+		UpdateDuration(EffectForWrite(data->effectBlockIndex), data->loopCount);
+		UpdateEnvelope(EffectForWrite(data->effectBlockIndex));
+		ArmEffect(data->effectBlockIndex);
 	}
 	else if (data->operation == 3)
 	{ // Stop
@@ -115,11 +635,13 @@ void PIDReportHandler::DeviceControl(USB_FFBReport_DeviceControl_Output_Data_t*
 
 	if (control == 0x01)
 	{ // 1=Enable Actuators
-		pidState.status |= 2;
+		pidState.status |= PID_STATUS_ACTUATORS_ENABLED;
+		EffectStateChanged(0);
 	}
 	else if (control == 0x02)
 	{ // 2=Disable Actuators
-		pidState.status &= ~(0x02);
+		pidState.status &= ~PID_STATUS_ACTUATORS_ENABLED;
+		EffectStateChanged(0);
 	}
 	else if (control == 0x03)
 	{ // 3=Stop All Effects
@@ -132,10 +654,14 @@ void PIDReportHandler::DeviceControl(USB_FFBReport_DeviceControl_Output_Data_t*
 	else if (control == 0x05)
 	{ // 5=Pause
 		devicePaused = 1;
+		pidState.status |= PID_STATUS_DEVICE_PAUSED;
+		EffectStateChanged(0);
 	}
 	else if (control == 0x06)
 	{ // 6=Continue
 		devicePaused = 0;
+		pidState.status &= ~PID_STATUS_DEVICE_PAUSED;
+		EffectStateChanged(0);
 	}
 	else if (control & (0xFF - 0x3F))
 	{
@@ -145,70 +671,156 @@ void PIDReportHandler::DeviceControl(USB_FFBReport_DeviceControl_Output_Data_t*
 void PIDReportHandler::DeviceGain(USB_FFBReport_DeviceGain_Output_Data_t* data)
 {
 	deviceGain.gain = data->gain;
+	InvalidateForceScales();
 }
 
 void PIDReportHandler::SetCustomForce(USB_FFBReport_SetCustomForce_Output_Data_t* data)
 {
+	if (data->effectBlockIndex == 0 || data->effectBlockIndex > MAX_EFFECTS)
+		return;
+	volatile TEffectParameters* effect = EffectForWrite(data->effectBlockIndex);
+	volatile TEffectState* buffer = &g_EffectStates[data->effectBlockIndex]; // pool blocks are runtime state
+	// samples beyond the pool are not played, a grown buffer keeps the old samples for the tick
+	uint8_t sampleCount = data->sampleCount;
+	if (!AllocateCustomForce(buffer, sampleCount))
+		sampleCount = buffer->customBlockCount * CUSTOM_FORCE_BLOCK_SIZE;
+	effect->sampleCount = min(data->sampleCount, sampleCount);
+	effect->samplePeriod = data->samplePeriod;
+	UpdateCustomForceStep(effect);
+	// Download Force Sample reports carry no effect index, they refill this effect from its first sample
+	downloadEffect = data->effectBlockIndex;
+	downloadOffset = 0;
 }
 
 void PIDReportHandler::SetCustomForceData(USB_FFBReport_SetCustomForceData_Output_Data_t* data)
 {
+	if (data->effectBlockIndex == 0 || data->effectBlockIndex > MAX_EFFECTS)
+		return;
+	volatile TEffectState* effect = &g_EffectStates[data->effectBlockIndex];
+	uint8_t sampleCount = PendingEffect(data->effectBlockIndex)->sampleCount;
+	uint16_t offset = data->dataOffset;
+	if (sampleCount)
+		offset %= sampleCount; // streamed data wraps around the ring
+	else if (!AllocateCustomForce(effect, offset + CUSTOM_FORCE_BLOCK_SIZE))
+		return; // data before Set Custom Force grows the buffer
+	uint16_t ringSize = sampleCount ? sampleCount : effect->customBlockCount * CUSTOM_FORCE_BLOCK_SIZE;
+	volatile int8_t* samples = &customForcePool[effect->customBlock * CUSTOM_FORCE_BLOCK_SIZE];
+	for (uint8_t i = 0; i < CUSTOM_FORCE_BLOCK_SIZE; i++) {
+		if (offset >= ringSize) offset = 0;
+		samples[offset++] = data->data[i];
+	}
 }
 
 void PIDReportHandler::SetDownloadForceSample(USB_FFBReport_SetDownloadForceSample_Output_Data_t* data)
 {
+	// appended to the ring of the last Set Custom Force effect, which is one channel: x is played
+	// along the effect direction and y is not used
+	uint8_t id = downloadEffect;
+	if (!EffectAllocated(id))
+		return;
+	volatile TEffectState* effect = &g_EffectStates[id];
+	uint8_t sampleCount = PendingEffect(id)->sampleCount;
+	uint16_t ringSize = sampleCount ? sampleCount : effect->customBlockCount * CUSTOM_FORCE_BLOCK_SIZE;
+	if (ringSize == 0)
+		return;
+	if (downloadOffset >= ringSize)
+		downloadOffset = 0;
+	customForcePool[effect->customBlock * CUSTOM_FORCE_BLOCK_SIZE + downloadOffset] = data->x;
+	downloadOffset++;
 }
 
 void PIDReportHandler::SetEffect(USB_FFBReport_SetEffect_Output_Data_t* data)
 {
-	volatile TEffectState* effect = &g_EffectStates[data->effectBlockIndex];
+	volatile TEffectParameters* effect = EffectForWrite(data->effectBlockIndex);
 
 	effect->duration = data->duration;
-	effect->directionX = data->directionX;
-	effect->directionY = data->directionY;
+	UpdateDuration(effect, 1);
+	effect->startDelay = data->startDelay;
+	effect->triggerRepeatInterval = data->triggerRepeatInterval;
+	effect->triggerButton = data->triggerButton;
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++)
+		effect->direction[axis] = data->direction[axis];
 	effect->effectType = data->effectType;
 	effect->gain = data->gain;
 	effect->enableAxis = data->enableAxis;
+	effect->scaleDirty = 1;
+	UpdateEnvelope(effect);
 }
 
-void PIDReportHandler::SetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectState* effect)
+void PIDReportHandler::SetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectParameters* effect)
 {
-	effect->attackLevel = data->attackLevel;
-	effect->fadeLevel = data->fadeLevel;
-	effect->attackTime = data->attackTime;
-	effect->fadeTime = data->fadeTime;
+	TEffectEnvelope envelope = {};
+	envelope.attackLevel = data->attackLevel;
+	envelope.fadeLevel = data->fadeLevel;
+	envelope.attackTime = data->attackTime;
+	envelope.fadeTime = data->fadeTime;
+	uint8_t block = ShareBlock(envelopeBlocks, envelopeRefs, FFB_ENVELOPE_BLOCKS + 1, effect->envelopeBlock, envelope);
+	if (block == SHARED_BLOCK_FULL) {
+		BlockPoolFull();
+		return;
+	}
+	ReleaseBlock(envelopeRefs, effect->envelopeBlock);
+	effect->envelopeBlock = block;
+	UpdateEnvelope(effect);
 }
 
-void PIDReportHandler::SetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectState* effect)
+void PIDReportHandler::SetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectParameters* effect)
 {
-	uint8_t axis = data->parameterBlockOffset; 
-    effect->conditions[axis].cpOffset = data->cpOffset;
-    effect->conditions[axis].positiveCoefficient = data->positiveCoefficient;
-    effect->conditions[axis].negativeCoefficient = data->negativeCoefficient;
-    effect->conditions[axis].positiveSaturation = data->positiveSaturation;
-    effect->conditions[axis].negativeSaturation = data->negativeSaturation;
-    effect->conditions[axis].deadBand = data->deadBand;
-	effect->conditionBlocksCount++;
+	uint8_t axis = data->parameterBlockOffset & 0x0F;
+	if (axis >= MAX_FFB_AXIS_COUNT)
+		return;
+	TEffectCondition condition = {};
+    condition.cpOffset = data->cpOffset;
+    condition.positiveCoefficient = data->positiveCoefficient;
+    condition.negativeCoefficient = data->negativeCoefficient;
+    condition.positiveSaturation = data->positiveSaturation;
+    condition.negativeSaturation = data->negativeSaturation;
+    condition.deadBand = data->deadBand;
+	uint8_t block = ShareBlock(conditionBlocks, conditionRefs, FFB_CONDITION_BLOCKS + 1, effect->conditionBlock[axis], condition);
+	if (block == SHARED_BLOCK_FULL) {
+		BlockPoolFull();
+		return;
+	}
+	ReleaseBlock(conditionRefs, effect->conditionBlock[axis]);
+	effect->conditionBlock[axis] = block;
+	// blocks defined so far, an update of an axis already set does not add one
+	effect->conditionBlocksCount = max(effect->conditionBlocksCount, (uint8_t)(axis + 1));
+	effect->scaleDirty = 1; // direction use depends on the block count
 }
 
-void PIDReportHandler::SetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectState* effect)
+void PIDReportHandler::SetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectParameters* effect)
 {
-	effect->magnitude = data->magnitude;
-	effect->offset = data->offset;
-	effect->phase = data->phase;
-	effect->period = data->period;
+	TEffectPeriodic periodic = {};
+	periodic.magnitude = data->magnitude;
+	periodic.offset = data->offset;
+	periodic.phase = (uint32_t)(data->phase % 36000) * 65536 / 36000;
+	periodic.period = data->period;
+	periodic.periodicMin = periodic.offset * 2 - (int16_t)data->magnitude;
+	periodic.periodicRange = data->magnitude * 2;
+	uint8_t block = ShareBlock(periodicBlocks, periodicRefs, FFB_PERIODIC_BLOCKS + 1, effect->periodicBlock, periodic);
+	if (block == SHARED_BLOCK_FULL) {
+		BlockPoolFull();
+		return;
+	}
+	ReleaseBlock(periodicRefs, effect->periodicBlock);
+	effect->periodicBlock = block;
+	// 0 period is a static waveform held at its phase
+	effect->phaseIncrement = data->period ? (0xFFFFFFFFUL / data->period + 500) / 1000 : 0;
+	UpdateEnvelope(effect);
 }
 
-void PIDReportHandler::SetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectState* effect)
+void PIDReportHandler::SetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectParameters* effect)
 {
 	//  ReportPrint(*effect);
 	effect->magnitude = data->magnitude;
+	UpdateEnvelope(effect);
 }
 
-void PIDReportHandler::SetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectState* effect)
+void PIDReportHandler::SetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectParameters* effect)
 {
 	effect->startMagnitude = data->startMagnitude;
 	effect->endMagnitude = data->endMagnitude;
+	UpdateEnvelope(effect);
 }
 
 void PIDReportHandler::CreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData)
@@ -228,12 +840,26 @@ void PIDReportHandler::CreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Dat
 
 		memset((void*)effect, 0, sizeof(TEffectState));
 		effect->state = MEFFECTSTATE_ALLOCATED;
-		pidBlockLoad.ramPoolAvailable -= SIZE_EFFECT;
+		// custom force samples (one byte each) are reserved up front, a full pool fails the load
+		if (inData->byteCount && !AllocateCustomForce(effect, inData->byteCount)) {
+			FreeEffect(pidBlockLoad.effectBlockIndex);
+			pidBlockLoad.effectBlockIndex = 0;
+			pidBlockLoad.loadStatus = 2;
+			pidBlockLoad.ramPoolAvailable = GetPoolAvailable();
+			return;
+		}
+		// a commit of the freed effect may still be copying, the new parameters start from a cleared shadow
+		DropShadows(pidBlockLoad.effectBlockIndex);
+		volatile TEffectParameters* params = EffectForWrite(pidBlockLoad.effectBlockIndex);
+		if (params != effect)
+			memset((void*)params, 0, EFFECT_PARAMETERS_SIZE);
 	}
+	pidBlockLoad.ramPoolAvailable = GetPoolAvailable();
 }
 
 void PIDReportHandler::UppackUsbData(uint8_t* data, uint16_t len)
 {
+	FFB_PROFILE_SCOPE(FFB_PROFILE_UNPACK);
 	//Serial.print("len:");
 	//Serial.println(len);
 	uint8_t effectId = data[1]; // effectBlockIndex is always the second byte.
@@ -247,23 +873,26 @@ void PIDReportHandler::UppackUsbData(uint8_t* data, uint16_t len)
 		break;
 	case 2:
 		//Serial.println("SetEnvelop");
-		SetEnvelope((USB_FFBReport_SetEnvelope_Output_Data_t*)data, &g_EffectStates[effectId]);
+		if (EffectAllocated(effectId))
+			SetEnvelope((USB_FFBReport_SetEnvelope_Output_Data_t*)data, EffectForWrite(effectId));
 		break;
 	case 3:
 		//Serial.println("SetCondition");
-		SetCondition((USB_FFBReport_SetCondition_Output_Data_t*)data, &g_EffectStates[effectId]);
+		if (EffectAllocated(effectId))
+			SetCondition((USB_FFBReport_SetCondition_Output_Data_t*)data, EffectForWrite(effectId));
 		break;
 	case 4:
 		//Serial.println("SetPeriodic");
-		SetPeriodic((USB_FFBReport_SetPeriodic_Output_Data_t*)data, &g_EffectStates[effectId]);
+		if (EffectAllocated(effectId))
+			SetPeriodic((USB_FFBReport_SetPeriodic_Output_Data_t*)data, EffectForWrite(effectId));
 		break;
 	case 5:
 		//Serial.println("SetConstantForce");
-		SetConstantForce((USB_FFBReport_SetConstantForce_Output_Data_t*)data, &g_EffectStates[effectId]);
+		SetConstantForce((USB_FFBReport_SetConstantForce_Output_Data_t*)data, EffectForWrite(effectId));
 		break;
 	case 6:
 		//Serial.println("SetRampForce");
-		SetRampForce((USB_FFBReport_SetRampForce_Output_Data_t*)data, &g_EffectStates[effectId]);
+		SetRampForce((USB_FFBReport_SetRampForce_Output_Data_t*)data, EffectForWrite(effectId));
 		break;
 	case 7:
 		//Serial.println("SetCustomForceData");
@@ -302,8 +931,6 @@ void PIDReportHandler::UppackUsbData(uint8_t* data, uint16_t len)
 
 uint8_t* PIDReportHandler::getPIDPool()
 {
-	FreeAllEffects();
-
 	pidPoolReport.reportId = 7;
 	pidPoolReport.ramPoolSize = MEMORY_SIZE;
 	pidPoolReport.maxSimultaneousEffects = MAX_EFFECTS;
@@ -311,6 +938,73 @@ uint8_t* PIDReportHandler::getPIDPool()
 	return (uint8_t*)& pidPoolReport;
 }
 
+#if FFB_LATENCY_STATS
+void PIDReportHandler::StampLatency(uint32_t now)
+{
+	// called for every OUT packet, only the oldest one waiting for the force tick counts
+	if (!latencyStamped) {
+		latencyStamp = now;
+		latencyStamped = 1;
+	}
+}
+
+bool PIDReportHandler::TakeLatencyStamp(uint32_t& stamp)
+{
+	FFB_CRITICAL_BEGIN();
+	bool stamped = latencyStamped;
+	stamp = latencyStamp;
+	latencyStamped = 0;
+	FFB_CRITICAL_END();
+	return stamped;
+}
+
+void PIDReportHandler::AddLatency(uint32_t us)
+{
+	uint16_t us16 = us > 0xFFFF ? 0xFFFF : us;
+	if (us16 < latency.minUs)
+		latency.minUs = us16;
+	if (us16 > latency.maxUs)
+		latency.maxUs = us16;
+	if (latency.totalUs + us < latency.totalUs) {
+		latency.totalUs >>= 1;
+		latency.count >>= 1;
+	}
+	latency.totalUs += us;
+	latency.count++;
+	uint32_t bin = us >> FFB_LATENCY_BIN_SHIFT;
+	if (bin >= FFB_LATENCY_BINS)
+		bin = FFB_LATENCY_BINS - 1;
+	if (latency.bins[bin] == 0xFFFF) {
+		for (uint8_t i = 0; i < FFB_LATENCY_BINS; i++)
+			latency.bins[i] >>= 1;
+	}
+	latency.bins[bin]++;
+}
+
+void PIDReportHandler::ResetLatency(void)
+{
+	memset(&latency, 0, sizeof(latency));
+	latency.binShift = FFB_LATENCY_BIN_SHIFT;
+	latency.minUs = 0xFFFF;
+}
+
+uint8_t* PIDReportHandler::getLatency()
+{
+	// p99 from the histogram as the upper edge of its bin, never above the maximum
+	uint32_t total = 0;
+	for (uint8_t i = 0; i < FFB_LATENCY_BINS; i++)
+		total += latency.bins[i];
+	uint32_t target = total - total / 100;
+	uint32_t sum = 0;
+	uint8_t bin = 0;
+	while (bin < FFB_LATENCY_BINS - 1 && (sum += latency.bins[bin]) < target)
+		bin++;
+	uint32_t edge = (uint32_t)(bin + 1) << FFB_LATENCY_BIN_SHIFT;
+	latency.p99Us = (total == 0) ? 0 : (bin == FFB_LATENCY_BINS - 1 || edge > latency.maxUs) ? latency.maxUs : edge;
+	return (uint8_t*)& latency;
+}
+#endif
+
 uint8_t* PIDReportHandler::getPIDBlockLoad()
 {
 	return (uint8_t*)& pidBlockLoad;
@@ -319,4 +1013,22 @@ uint8_t* PIDReportHandler::getPIDBlockLoad()
 uint8_t* PIDReportHandler::getPIDStatus()
 {
 	return (uint8_t*)& pidState;
+}
+
+uint8_t* PIDReportHandler::getPIDStateChange(uint32_t now)
+{
+	// one effect per report, lowest id first, NULL when there is nothing to send yet
+	if (!pidStateChanges || now - pidStateSentUs < PID_STATE_REPORT_INTERVAL)
+		return NULL;
+	FFB_CRITICAL_BEGIN();
+	uint32_t changes = pidStateChanges;
+	uint8_t id = pidState.effectBlockIndex >> 1; // a device status change repeats the last effect
+	if (changes & ~1UL) {
+		for (id = 1; !(changes & (1UL << id)); id++);
+	}
+	pidStateChanges = changes & ~((1UL << id) | 1UL);
+	pidState.effectBlockIndex = (id << 1) | ((g_EffectStates[id].state & MEFFECTSTATE_PLAYING) ? PID_STATUS_EFFECT_PLAYING : 0);
+	FFB_CRITICAL_END();
+	pidStateSentUs = now;
+	return (uint8_t*)& pidState;
 }
\ No newline at end of file
@@ -2,6 +2,24 @@
 #define _PIDREPORTHANDLER_H
 #include <Arduino.h>
 #include "PIDReportType.h"
+#include "FFBProfile.h"
+
+// free-running 32-bit microsecond timer used as the effect timebase
+#ifndef FFB_TIME_NOW
+#define FFB_TIME_NOW() micros()
+#endif
+
+// interrupts off around state shared with the USB interrupt, restored as found so sections nest
+#if defined(__AVR__)
+#define FFB_CRITICAL_BEGIN() uint8_t ffbInterruptState = SREG; cli()
+#define FFB_CRITICAL_END() SREG = ffbInterruptState
+#elif defined(__arm__)
+#define FFB_CRITICAL_BEGIN() uint32_t ffbInterruptState = __get_PRIMASK(); __disable_irq()
+#define FFB_CRITICAL_END() __set_PRIMASK(ffbInterruptState)
+#else
+#define FFB_CRITICAL_BEGIN() noInterrupts() // other cores: nothing saved, a nested section ends early
+#define FFB_CRITICAL_END() interrupts()
+#endif
 
 class PIDReportHandler {
 public:
@@ -16,17 +34,78 @@ public:
 	volatile int16_t oldSpeed = 0;
 	volatile int16_t oldAxisPosition = 0;
 	volatile USB_FFBReport_PIDStatus_Input_Data_t pidState = { 2, 30, 0 };
+	volatile uint32_t pidStateChanges; // bit per effect id with a playing change not reported yet, bit 0 = device status
+	uint32_t pidStateSentUs;
 	volatile USB_FFBReport_PIDBlockLoad_Feature_Data_t pidBlockLoad;
 	volatile USB_FFBReport_PIDPool_Feature_Data_t pidPoolReport;
 	volatile USB_FFBReport_DeviceGain_Output_Data_t deviceGain;
+	//custom force samples, allocated in blocks to the effects
+	volatile int8_t customForcePool[CUSTOM_FORCE_POOL_BLOCKS * CUSTOM_FORCE_BLOCK_SIZE];
+	volatile uint32_t customForceBlocksUsed;
+	volatile uint8_t downloadEffect; // custom force effect fed by Download Force Sample, 0 = none
+	volatile uint16_t downloadOffset; // next sample it writes
+	//effect scheduling, playing effects form a list and pending events sit in a timer wheel
+	volatile uint8_t activeEffects; // first playing effect, 0 = none
+	volatile uint8_t timerWheel[FFB_TIMER_SLOTS];
+	uint32_t timerSlot; // last slot processed
+	volatile uint32_t armedEffects; // bit per effect id waiting for its trigger button
+	uint8_t triggerButtons; // trigger button state of the previous tick
+	//host writes go to shadow copies of the effect parameters, the force tick commits them
+	volatile TEffectParameters shadowEffects[FFB_SHADOW_EFFECTS];
+	volatile uint8_t shadowOwner[FFB_SHADOW_EFFECTS]; // effect id, 0 = free
+	volatile uint8_t shadowCommitting; // shadow being copied by the force tick, 0xFF = none
+	//shared parameter blocks, identical blocks are stored once, block 0 is all zero
+	volatile TEffectEnvelope envelopeBlocks[FFB_ENVELOPE_BLOCKS + 1];
+	volatile TEffectCondition conditionBlocks[FFB_CONDITION_BLOCKS + 1];
+	volatile TEffectPeriodic periodicBlocks[FFB_PERIODIC_BLOCKS + 1];
+	volatile uint8_t envelopeRefs[FFB_ENVELOPE_BLOCKS + 1];
+	volatile uint8_t conditionRefs[FFB_CONDITION_BLOCKS + 1];
+	volatile uint8_t periodicRefs[FFB_PERIODIC_BLOCKS + 1];
+	volatile uint8_t blockPoolFull; // an update found no free block, cleared when an effect is freed
+#if FFB_LATENCY_STATS
+	//latency of host updates, the oldest OUT packet not yet reflected in a force is stamped
+	volatile uint32_t latencyStamp;
+	volatile uint8_t latencyStamped;
+	FFBLatencyStats latency;
+#endif
 
 	//ffb state structures
 	uint8_t GetNextFreeEffect(void);
 	void StartEffect(uint8_t id);
 	void StopEffect(uint8_t id);
+	void ArmEffect(uint8_t id);
+	void BeginEffect(uint8_t id);
+	void EndEffect(uint8_t id);
 	void StopAllEffects(void);
 	void FreeEffect(uint8_t id);
 	void FreeAllEffects(void);
+	uint16_t GetPoolAvailable(void);
+	bool EffectAllocated(uint8_t id);
+	void BlockPoolFull(void);
+	volatile TEffectParameters* EffectForWrite(uint8_t id);
+	volatile TEffectParameters* PendingEffect(uint8_t id);
+	void DropShadows(uint8_t id);
+	void CommitEffects(void);
+	void ShareBlocks(volatile TEffectParameters* effect, volatile TEffectParameters* from);
+	void ReleaseBlocks(volatile TEffectParameters* effect);
+	void ClearBlocks(void);
+	void EffectStateChanged(uint8_t id);
+	void UpdateDuration(volatile TEffectParameters* effect, uint8_t loopCount);
+	void UpdateEnvelope(volatile TEffectParameters* effect);
+	void InvalidateForceScales(void);
+	void AddTimer(uint8_t id, uint32_t due);
+	void CancelTimer(uint8_t id);
+	void EffectTimer(uint8_t id, uint32_t now);
+	void RunScheduler(uint32_t now, uint8_t buttons);
+	bool AllocateCustomForce(volatile TEffectState* effect, uint16_t samples);
+	void FreeCustomForce(volatile TEffectState* effect);
+	void UpdateCustomForceStep(volatile TEffectParameters* effect);
+#if FFB_LATENCY_STATS
+	void StampLatency(uint32_t now);
+	bool TakeLatencyStamp(uint32_t& stamp);
+	void AddLatency(uint32_t us);
+	void ResetLatency(void);
+#endif
 
 	//handle output pid report
 	void EffectOperation(USB_FFBReport_EffectOperation_Output_Data_t* data);
@@ -37,11 +116,11 @@ public:
 	void SetDownloadForceSample(USB_FFBReport_SetDownloadForceSample_Output_Data_t* data);
 	void SetCustomForce(USB_FFBReport_SetCustomForce_Output_Data_t* data);
 	void SetEffect(USB_FFBReport_SetEffect_Output_Data_t* data);
-	void SetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectState* effect);
-	void SetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectState* effect);
-	void SetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectState* effect);
-	void SetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectState* effect);
-	void SetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectState* effect);
+	void SetEnvelope(USB_FFBReport_SetEnvelope_Output_Data_t* data, volatile TEffectParameters* effect);
+	void SetCondition(USB_FFBReport_SetCondition_Output_Data_t* data, volatile TEffectParameters* effect);
+	void SetPeriodic(USB_FFBReport_SetPeriodic_Output_Data_t* data, volatile TEffectParameters* effect);
+	void SetConstantForce(USB_FFBReport_SetConstantForce_Output_Data_t* data, volatile TEffectParameters* effect);
+	void SetRampForce(USB_FFBReport_SetRampForce_Output_Data_t* data, volatile TEffectParameters* effect);
 
 	// Handle incoming data from USB
 	void CreateNewEffect(USB_FFBReport_CreateNewEffect_Feature_Data_t* inData);
@@ -49,5 +128,9 @@ public:
 	uint8_t* getPIDPool();
 	uint8_t* getPIDBlockLoad();
 	uint8_t* getPIDStatus();
+	uint8_t* getPIDStateChange(uint32_t now);
+#if FFB_LATENCY_STATS
+	uint8_t* getLatency();
+#endif
 };
 #endif
@@ -26,11 +26,52 @@
 
 #ifndef _PIDREPORTTYPE_H
 #define _PIDREPORTTYPE_H
+#include <stddef.h>
 
 #define MAX_EFFECTS 14
-#define MAX_FFB_AXIS_COUNT 0x02
+#define PID_REPORT_ID_MAX 14 // PID reports use the IDs 1..14, see FFBDescriptor.h
+#ifndef MAX_FFB_AXIS_COUNT
+#define MAX_FFB_AXIS_COUNT 2 // force feedback axes X, Y, Z, Rx, Ry, Rz in this order, 1..6
+#endif
 #define SIZE_EFFECT sizeof(TEffectState)
-#define MEMORY_SIZE (uint16_t)(MAX_EFFECTS*SIZE_EFFECT)
+#define MEMORY_SIZE (uint16_t)(MAX_EFFECTS*SIZE_EFFECT + SHARED_BLOCKS_SIZE + CUSTOM_FORCE_POOL_BLOCKS*CUSTOM_FORCE_BLOCK_SIZE) // effect, parameter and custom force blocks
+#define CUSTOM_FORCE_BLOCK_SIZE 12 // samples per Custom Force Data report
+#ifndef CUSTOM_FORCE_POOL_BLOCKS
+#define CUSTOM_FORCE_POOL_BLOCKS 16 // blocks in the shared custom force sample pool, at most 32
+#endif
+#ifndef FFB_TIMER_SLOTS
+#define FFB_TIMER_SLOTS 16 // effect timer wheel slots, power of 2
+#endif
+#define FFB_TIMER_SLOT_SHIFT 10 // slot width 1024 us
+#ifndef FFB_SHADOW_EFFECTS
+#define FFB_SHADOW_EFFECTS 3 // effects with parameter updates waiting for the next force tick
+#endif
+#define EFFECT_PARAMETERS_SIZE offsetof(TEffectParameters, envelopeBlock) // host parameter values, the block references are counted
+// shared parameter blocks, sized for the distinct parameter sets a game keeps loaded at once;
+// an update that finds its pool full is dropped and Block Load reports Full until an effect is freed
+#ifndef FFB_ENVELOPE_BLOCKS
+#define FFB_ENVELOPE_BLOCKS 6 // shared envelope parameter blocks
+#endif
+#ifndef FFB_CONDITION_BLOCKS
+#define FFB_CONDITION_BLOCKS (4 * MAX_FFB_AXIS_COUNT) // shared condition parameter blocks, spring, damper, inertia and friction per axis
+#endif
+#ifndef FFB_PERIODIC_BLOCKS
+#define FFB_PERIODIC_BLOCKS 6 // shared periodic parameter blocks
+#endif
+#define SHARED_BLOCK_FULL 0xFF
+#define SHARED_BLOCKS_SIZE (FFB_ENVELOPE_BLOCKS*sizeof(TEffectEnvelope) + FFB_CONDITION_BLOCKS*sizeof(TEffectCondition) + FFB_PERIODIC_BLOCKS*sizeof(TEffectPeriodic))
+#ifndef PID_STATE_REPORT_INTERVAL
+#define PID_STATE_REPORT_INTERVAL 2000 // us, minimum time between two PID State input reports
+#endif
+#ifndef FFB_LATENCY_STATS
+#define FFB_LATENCY_STATS 0 // 1 = histogram of the time from OUT packet to force, see PIDReportHandler::latency
+#endif
+#define FFB_LATENCY_BINS 32
+#ifndef FFB_LATENCY_BIN_SHIFT
+#define FFB_LATENCY_BIN_SHIFT 7 // latency bin width 128 us, the last bin holds everything above
+#endif
+#define ENVELOPE_SCALE_SHIFT 12
+#define ENVELOPE_SCALE_ONE (1 << ENVELOPE_SCALE_SHIFT)
 #define TO_LT_END_16(x) ((x<<8)&0xFF00)|((x>>8)&0x00FF)
 
 
@@ -42,9 +83,13 @@ typedef struct//PID state
 {
 	uint8_t reportId;//2
 	uint8_t	status;// Bits: 0=Device Paused,1=Actuators Enabled,2=Safety Switch,3=Actuator Override Switch,4=Actuator Power
-	uint8_t	effectBlockIndex;// Bit7=Effect Playing, Bit0..7=EffectId (1..40)
+	uint8_t	effectBlockIndex;// Bit0=Effect Playing, Bit1..7=EffectId (1..40)
 }USB_FFBReport_PIDStatus_Input_Data_t;
 
+#define PID_STATUS_DEVICE_PAUSED		0x01
+#define PID_STATUS_ACTUATORS_ENABLED	0x02
+#define PID_STATUS_EFFECT_PLAYING		0x01 // effectBlockIndex bit, the index is shifted left by one
+
 ///Host-->Device
 
 typedef struct //FFB: Set Effect Output Report
@@ -57,10 +102,9 @@ typedef struct //FFB: Set Effect Output Report
 	uint16_t samplePeriod;	// 0..32767 ms
 	uint8_t	gain;	// 0..255	 (physical 0..10000)
 	uint8_t	triggerButton;	// button ID (0..8)
-	uint8_t	enableAxis; // bits: 0=X, 1=Y, 2=DirectionEnable
-	uint8_t	directionX;	// angle (0=0 .. 255=360deg)
-	uint8_t	directionY;	// angle (0=0 .. 255=360deg)
-	//	uint16_t	startDelay;	// 0..32767 ms
+	uint8_t	enableAxis; // bits: 0..MAX_FFB_AXIS_COUNT-1=axes, MAX_FFB_AXIS_COUNT=DirectionEnable
+	uint8_t	direction[MAX_FFB_AXIS_COUNT];	// angle (0=0 .. 255=360deg)
+	uint16_t	startDelay;	// 0..32767 ms
 } USB_FFBReport_SetEffect_Output_Data_t;
 
 typedef struct//FFB: Set Envelope Output Report
@@ -77,7 +121,7 @@ typedef struct// FFB: Set Condition Output Report
 {
 	uint8_t	reportId;	// =3
 	uint8_t	effectBlockIndex;	// 1..40
-	uint8_t	parameterBlockOffset;	// bits: 0..3=parameterBlockOffset, 4..5=instance1, 6..7=instance2
+	uint8_t	parameterBlockOffset;	// bits: 0..3=parameterBlockOffset (axis), 4..5=instance1, 6..7=instance2
 	int16_t cpOffset;	// 0..255
 	int16_t	positiveCoefficient;	// -128..127
 	int16_t	negativeCoefficient;	// -128..127
@@ -173,17 +217,26 @@ typedef struct// FFB: PID Block Load Feature Report
 	uint8_t	reportId;	// =6
 	uint8_t effectBlockIndex;	// 1..40
 	uint8_t	loadStatus;	// 1=Success,2=Full,3=Error
-	uint16_t	ramPoolAvailable;	// =0 or 0xFFFF?
+	uint16_t	ramPoolAvailable;	// bytes, free effect blocks and free custom force samples
 } USB_FFBReport_PIDBlockLoad_Feature_Data_t;
 
 typedef struct// FFB: PID Pool Feature Report
 {
 	uint8_t	reportId;	// =7
-	uint16_t	ramPoolSize;	// ?
+	uint16_t	ramPoolSize;	// bytes, MEMORY_SIZE
 	uint8_t		maxSimultaneousEffects;	// ?? 40?
 	uint8_t		memoryManagement;	// Bits: 0=DeviceManagedPool, 1=SharedParameterBlocks
 } USB_FFBReport_PIDPool_Feature_Data_t;
 
+typedef struct// FFB latency histogram, OUT packet received to the first force computed after it
+{
+	uint8_t	reportId;
+	uint8_t	binShift;	// bin width 1 << binShift us
+	uint16_t	minUs, maxUs, p99Us;	// saturate at 65535, p99Us is the upper edge of its bin or maxUs
+	uint32_t	count, totalUs;	// average = totalUs / count, both halve together before totalUs overflows
+	uint16_t	bins[FFB_LATENCY_BINS];	// all bins halve when one is full
+} FFBLatencyStats;
+
 typedef struct {
 	int16_t cpOffset; // -128..127
 	int16_t  positiveCoefficient; // -128..127
@@ -194,8 +247,29 @@ typedef struct {
 	
 } TEffectCondition;
 
+typedef struct {
+	int16_t attackLevel, fadeLevel;
+	uint16_t attackTime, fadeTime; // ms
+} TEffectEnvelope;
+
+typedef struct {
+	int16_t magnitude;
+	int16_t offset;
+	uint16_t phase;  // 0..65535 (=0..360deg), converted from 0..35999 (exp-2)
+	uint16_t period; // 0..32767 ms
+	int16_t periodicMin; // offset - magnitude
+	uint16_t periodicRange; // peak to peak, 2 * magnitude
+} TEffectPeriodic;
+
+typedef struct {
+	int16_t mantissa;
+	uint8_t shift;
+} TForceScale; // force * mantissa >> shift
+
 ///effect
 #define USB_DURATION_INFINITE		0x7FFF
+#define FFB_TIME_INFINITE			0xFFFFFFFFUL // us, never reached by the elapsed time
+#define FFB_TIME_MAX				0x7FFFFFFFUL // us, elapsed time saturates here (~35 min)
 
 #define USB_EFFECT_CONSTANT	  		0x01
 #define USB_EFFECT_RAMP				0x02
@@ -213,39 +287,65 @@ typedef struct {
 #define MEFFECTSTATE_FREE			0x00
 #define MEFFECTSTATE_ALLOCATED		0x01
 #define MEFFECTSTATE_PLAYING		0x02
+#define MEFFECTSTATE_DELAYED		0x04 // start delay running
+#define MEFFECTSTATE_ARMED			0x08 // started, waits for its trigger button
 
 #define X_AXIS_ENABLE				0x01
 #define Y_AXIS_ENABLE				0x02
-#define DIRECTION_ENABLE			0x04
+#define DIRECTION_ENABLE			(1 << MAX_FFB_AXIS_COUNT)
 //these were needed for testing
 #define INERTIA_FORCE 				0xFF
 #define FRICTION_FORCE				0xFF
 #define INERTIA_DEADBAND			0x30
 #define FRICTION_DEADBAND			0x30
 
+//host parameters, written to a shadow copy and committed at the next force tick (see CommitEffects)
 typedef struct {
-	volatile uint8_t state;  // see constants <MEffectState_*>
 	uint8_t effectType; //
-	int16_t offset;
 	uint8_t gain;
-	//envelop
-	int16_t attackLevel, fadeLevel;
-	uint16_t fadeTime, attackTime;
+	//envelop, derived from the envelope block, the magnitude and the duration
+	uint8_t hasEnvelope;
+	uint16_t attackScale, fadeScale; // Q12 level / magnitude
+	uint32_t attackTimeUs; // us
+	uint32_t fadeStartUs; // us, FFB_TIME_INFINITE = no fade
+	uint32_t attackStep, fadeStep; // segment progress per us (2^32 = whole segment)
 
-	int16_t magnitude;
+	int16_t magnitude; // constant force
 	//direction
-	uint8_t enableAxis; // bits: 0=X, 1=Y, 2=DirectionEnable
-	uint8_t directionX; // angle (0=0 .. 255=360deg)
-	uint8_t directionY; // angle (0=0 .. 255=360deg)
+	uint8_t enableAxis; // bits: 0..MAX_FFB_AXIS_COUNT-1=axes, MAX_FFB_AXIS_COUNT=DirectionEnable
+	uint8_t direction[MAX_FFB_AXIS_COUNT]; // angle (0=0 .. 255=360deg), polar/spherical with DirectionEnable
 	uint8_t conditionBlocksCount;
-    //condition
-	TEffectCondition conditions[MAX_FFB_AXIS_COUNT];
-    //periodic
-	uint16_t phase;  // 0..255 (=0..359, exp-2)
 	int16_t startMagnitude;
 	int16_t  endMagnitude;
-	uint16_t  period; // 0..32767 ms
-	uint16_t duration, elapsedTime;
-	uint64_t startTime;
-} TEffectState;
+	uint32_t phaseIncrement; // phase accumulator step per us (2^32 = one period), periodic and custom force
+	uint32_t rampStep; // ramp progress per us (2^32 = full duration)
+	//custom force, ring of samples in the shared pool, played by the phase accumulator
+	uint8_t sampleCount;
+	uint16_t samplePeriod; // ms
+	uint16_t duration; // ms, as reported
+	uint32_t durationUs; // us including loops, FFB_TIME_INFINITE = until stopped
+	uint16_t startDelay, triggerRepeatInterval; // ms
+	uint8_t triggerButton; // 1..8, other values = no trigger
+	uint8_t scaleDirty; // gain, direction, axes or condition blocks changed, the commit invalidates the force scale
+	//shared parameter blocks, 0 = all zero, every copy of the effect holds a counted reference
+	uint8_t envelopeBlock;
+	uint8_t periodicBlock;
+	uint8_t conditionBlock[MAX_FFB_AXIS_COUNT];
+} TEffectParameters;
+
+//runtime state, owned by the force tick and the scheduler, always written in place
+struct TEffectState : TEffectParameters {
+	volatile uint8_t state;  // see constants <MEffectState_*>
+	uint32_t phaseAccumulator; // advanced once per tick, upper 16 bits = phase
+	uint8_t customBlock, customBlockCount; // first pool block and blocks owned
+	uint32_t startUs, elapsedUs; // effect timebase, see FFB_TIME_NOW
+	//scheduling
+	uint8_t nextActive; // next playing effect, 0 = end of the list
+	uint8_t nextTimer; // next effect in the same timer wheel slot, 0 = end of the list
+	uint8_t timerPending;
+	uint32_t timerDue; // us
+	//combined effect gain, device gain, axis gains, direction and output range
+	TForceScale axisScale[MAX_FFB_AXIS_COUNT];
+	uint8_t scaleValid; // cleared when any of the above changes
+};
 #endif
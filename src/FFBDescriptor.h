@@ -2,6 +2,29 @@
 #ifndef _FFB_H
 #define _FFB_H
 
+#if MAX_FFB_AXIS_COUNT < 1 || MAX_FFB_AXIS_COUNT > 6
+#error "MAX_FFB_AXIS_COUNT must be 1..6"
+#endif
+
+// FFB axis usages (Generic Desktop X, Y, Z, Rx, Ry, Rz) and their ordinals, first MAX_FFB_AXIS_COUNT
+#define FFB_AXIS_USAGES_1 0x09, 0x30
+#define FFB_AXIS_USAGES_2 FFB_AXIS_USAGES_1, 0x09, 0x31
+#define FFB_AXIS_USAGES_3 FFB_AXIS_USAGES_2, 0x09, 0x32
+#define FFB_AXIS_USAGES_4 FFB_AXIS_USAGES_3, 0x09, 0x33
+#define FFB_AXIS_USAGES_5 FFB_AXIS_USAGES_4, 0x09, 0x34
+#define FFB_AXIS_USAGES_6 FFB_AXIS_USAGES_5, 0x09, 0x35
+#define FFB_AXIS_ORDINALS_1 0x0B, 0x01, 0, 0x0A, 0
+#define FFB_AXIS_ORDINALS_2 FFB_AXIS_ORDINALS_1, 0x0B, 0x02, 0, 0x0A, 0
+#define FFB_AXIS_ORDINALS_3 FFB_AXIS_ORDINALS_2, 0x0B, 0x03, 0, 0x0A, 0
+#define FFB_AXIS_ORDINALS_4 FFB_AXIS_ORDINALS_3, 0x0B, 0x04, 0, 0x0A, 0
+#define FFB_AXIS_ORDINALS_5 FFB_AXIS_ORDINALS_4, 0x0B, 0x05, 0, 0x0A, 0
+#define FFB_AXIS_ORDINALS_6 FFB_AXIS_ORDINALS_5, 0x0B, 0x06, 0, 0x0A, 0
+#define FFB_CONCAT_(a, b) a##b
+#define FFB_CONCAT(a, b) FFB_CONCAT_(a, b)
+#define FFB_AXIS_USAGES FFB_CONCAT(FFB_AXIS_USAGES_, MAX_FFB_AXIS_COUNT)
+#define FFB_AXIS_ORDINALS FFB_CONCAT(FFB_AXIS_ORDINALS_, MAX_FFB_AXIS_COUNT)
+#define FFB_PARAMETER_BLOCK_MAX (MAX_FFB_AXIS_COUNT > 4 ? MAX_FFB_AXIS_COUNT - 1 : 3)
+
 static const uint8_t pidReportDescriptor[] PROGMEM= {
   // PID State Report
   0x05, 0x0F,          // USAGE_PAGE (Physical Interface)
@@ -110,12 +133,11 @@ static const uint8_t pidReportDescriptor[] PROGMEM= {
 	0x09, 0x55,           //    Usage (Axes Enable)
 	0xA1, 0x02,           //      Collection Datalink (Logical)
 	  0x05, 0x01,           //        Usage Page (Generic Desktop)
-	  0x09, 0x30,           //        Usage (X)//
-	  0x09, 0x31,           //        Usage (Y)//
+	  FFB_AXIS_USAGES,      //        Usage (X), Usage (Y), ...
 	  0x15, 0x00,           //        Logical Minimum (0)
 	  0x25, 0x01,           //        Logical Maximum (1)
 	  0x75, 0x01,           //        Report Size (1)
-	  0x95, 0x02,           //        Report Count (2)
+	  0x95, MAX_FFB_AXIS_COUNT, //     Report Count (axes)
 	  0x91, 0x02,           //        Output (Data,Var,Abs)
 	0xC0,                 //      End Collection Datalink (Logical)
 
@@ -123,12 +145,11 @@ static const uint8_t pidReportDescriptor[] PROGMEM= {
 	0x09, 0x56,           //      Usage (Direction Enable)
 	0x95, 0x01,           //        Report Count (1)
 	0x91, 0x02,           //        Output (Data,Var,Abs)
-	0x95, 0x05,           //        Report Count (5)
+	0x95, 7 - MAX_FFB_AXIS_COUNT, //   Report Count (padding to a byte)
 	0x91, 0x03,           //        Output (Constant, Variable)
 	0x09, 0x57,           //      Usage (Direction)
 	0xA1, 0x02,           //        Collection Datalink (Logical)
-	  0x0B, 0x01, 0, 0x0A, 0,  //          Usage (Ordinals: Instance 1)
-	  0x0B, 0x02, 0, 0x0A, 0,  //          Usage (Ordinals: Instance 2)
+	  FFB_AXIS_ORDINALS,    //          Usage (Ordinals: Instance 1), ...
 	  0x66, 0x14, 0x00,     //          Unit (20)
 	  0x55, 0xFE,           //          Unit Exponent (254)
 	  0x15, 0x00,           //          Logical Minimum (0)
@@ -137,21 +158,32 @@ static const uint8_t pidReportDescriptor[] PROGMEM= {
 	  0x47, 0xA0, 0x8C, 0, 0, //          Physical Maximum (36000)
 	  0x66, 0x00, 0x00,     //          Unit (0)
 	  0x75, 0x08,           //          Report Size (8)
-	  0x95, 0x02,           //          Report Count (2)
+	  0x95, MAX_FFB_AXIS_COUNT, //       Report Count (axes)
 	  0x91, 0x02,           //          Output (Data,Var,Abs)
 	  0x55, 0x00,           //          Unit Exponent (0)
 	  0x66, 0x00, 0x00,     //          Unit (0)
 	0xC0,                 //        End Collection Datalink (Logical)
+	0x09, 0xA7,           //      Usage (Start Delay)
+	0x66, 0x03, 0x10,     //        Unit (4099)
+	0x55, 0xFD,           //        Unit Exponent (253)
+	0x15, 0x00,           //        Logical Minimum (0)
+	0x26, 0xFF, 0x7F,     //        Logical Maximum (32767)
+	0x35, 0x00,           //        Physical Minimum (0)
+	0x46, 0xFF, 0x7F,     //        Physical Maximum (32767)
+	0x75, 0x10,           //        Report Size (16)
+	0x95, 0x01,           //        Report Count (1)
+	0x91, 0x02,           //        Output (Data,Var,Abs)
+	0x55, 0x00,           //        Unit Exponent (0)
+	0x66, 0x00, 0x00,     //        Unit (0)
 
 
 	0x05, 0x0F,           //    Usage Page (Physical Interface)
 	0x09, 0x58,           //      Usage (Type Specific Block Offset)
 	0xA1, 0x02,           //        Collection (Logical)
-	  0x0B, 0x01, 0, 0x0A, 0,  //          Usage (Ordinals: Instance 1)
-	  0x0B, 0x02, 0, 0x0A, 0,  //          Usage (Ordinals: Instance 2)
+	  FFB_AXIS_ORDINALS,    //          Usage (Ordinals: Instance 1), ...
 	  0x26, 0xFD, 0x7F,     //          Logical Maximum (32765); 32K RAM or ROM max.
 	  0x75, 0x10,           //          Report Size (16)
-	  0x95, 0x02,           //          Report Count (2)
+	  0x95, MAX_FFB_AXIS_COUNT, //       Report Count (axes)
 	  0x91, 0x02,           //          Output (Data,Var,Abs)
 	0xC0,                 //        End Collection (Logical)
   0xC0,                 //End Collection Datalink (Logical) (OK)
@@ -205,9 +237,9 @@ static const uint8_t pidReportDescriptor[] PROGMEM= {
 	0x91, 0x02,           //   Output (Data,Var,Abs)
 	0x09, 0x23,           //  Usage (Parameter Block Offset)
 	0x15, 0x00,           //   Logical Minimum (0)
-	0x25, 0x03,           //   Logical Maximum (3)
+	0x25, FFB_PARAMETER_BLOCK_MAX, // Logical Maximum (3 or axes - 1)
 	0x35, 0x00,           //   Physical Minimum (0)
-	0x45, 0x03,           //   Physical Maximum (3)
+	0x45, FFB_PARAMETER_BLOCK_MAX, // Physical Maximum (3 or axes - 1)
 	0x75, 0x04,           //   Report Size (4)
 	0x95, 0x01,           //   Report Count (1)
 	0x91, 0x02,           //   Output (Data,Var,Abs)
@@ -0,0 +1,33 @@
+#pragma once
+#ifndef _FFB_WAVETABLE_H
+#define _FFB_WAVETABLE_H
+
+// Quarter-wave sine table, sin(i * 90deg / 64) in Q15 (0..32767), i = 0..64.
+static const uint16_t ffbQuarterSineTable[65] PROGMEM = {
+	    0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+	 6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+	12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+	18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+	23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+	27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+	30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+	32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+	32767
+};
+
+// Sine of a 16-bit phase (0..65535 = 0..360deg), linearly interpolated, Q15 result.
+static inline int16_t FfbSine(uint16_t phase)
+{
+	uint16_t quarterPhase = phase & 0x3FFF;
+	if (phase & 0x4000) quarterPhase = 0x4000 - quarterPhase; // falling quarter, mirror
+	uint8_t index = quarterPhase >> 8;
+	uint8_t fraction = quarterPhase & 0xFF;
+	int16_t value = pgm_read_word(&ffbQuarterSineTable[index]);
+	if (fraction) {
+		int16_t next = pgm_read_word(&ffbQuarterSineTable[index + 1]);
+		value += (int16_t)(((int32_t)(next - value) * fraction) >> 8);
+	}
+	return (phase & 0x8000) ? -value : value;
+}
+
+#endif // _FFB_WAVETABLE_H
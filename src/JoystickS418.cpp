@@ -20,9 +20,22 @@
 
 #include "JoystickS418.h"
 #include "FFBDescriptor.h"
+#include "FFBWaveTable.h"
+
 #if defined(_USING_DYNAMIC_HID)
 
+static_assert(JOYSTICK_DEFAULT_REPORT_ID > PID_REPORT_ID_MAX, "joystick input reports must not reuse a PID report ID");
+static_assert(PID_REPORT_ID_MAX + DYNAMIC_HID_TRACKED_REPORT_IDS <= 0xFF, "report IDs are 8 bits");
+static_assert(DYNAMIC_HID_TRACKED_REPORT_IDS <= 32, "reportIdsUsed holds one bit per tracked report ID");
+
 #define JOYSTICK_REPORT_ID_INDEX 7
+
+// fully unroll the per-axis loops of the force tick, the axis count is a compile-time constant
+#if defined(__GNUC__) && (__GNUC__ >= 8)
+#define FFB_AXIS_LOOP _Pragma("GCC unroll 6")
+#else
+#define FFB_AXIS_LOOP
+#endif
 #define JOYSTICK_AXIS_MINIMUM -32767
 #define JOYSTICK_AXIS_MAXIMUM 32767
 #define JOYSTICK_SIMULATOR_MINIMUM -32767
@@ -219,6 +232,9 @@ this->hidReportId(JOYSTICK_DEFAULT_REPORT_ID)
 
 Joystick_& Joystick_::init()
 {
+    // Unique input report ID above the PID reports
+    _hidReportId = DynamicHID().AllocateReportId(_hidReportId);
+
     // Build Joystick HID Report Description
 
     // Button Calculations
@@ -249,7 +265,7 @@ Joystick_& Joystick_::init()
 	// USAGE (Pointer)
 	tempHidReportDescriptor[hidReportDescriptorSize++] = 0x09;
 	tempHidReportDescriptor[hidReportDescriptorSize++] = 0x01;
-    // REPORT_ID (Default: 1)
+    // REPORT_ID (Default: 15)
     tempHidReportDescriptor[hidReportDescriptorSize++] = 0x85;
     tempHidReportDescriptor[hidReportDescriptorSize++] = _hidReportId;
 
@@ -566,13 +582,12 @@ if (_hatSwitchCount > 0) {
     // END_COLLECTION (Application)
     tempHidReportDescriptor[hidReportDescriptorSize++] = 0xc0;
 
-    // Create a copy of the HID Report Descriptor template that is just the right size
-    uint8_t *customHidReportDescriptor = new uint8_t[hidReportDescriptorSize];
-    memcpy(customHidReportDescriptor, tempHidReportDescriptor, hidReportDescriptorSize);
-	// Register HID Report Description
-	DynamicHIDSubDescriptor* node = new DynamicHIDSubDescriptor(customHidReportDescriptor, hidReportDescriptorSize, pidReportDescriptor, pidReportDescriptorSize, false);
+	// Register HID Report Description, DynamicHID copies it into the interface descriptor
+	DynamicHIDSubDescriptor* node = new DynamicHIDSubDescriptor(tempHidReportDescriptor, hidReportDescriptorSize, pidReportDescriptor, pidReportDescriptorSize, false);
 
-    DynamicHID().AppendDescriptor(node);
+    // without a free report ID the instance stays off the device, sendPending() then remains true
+    if (_hidReportId)
+        DynamicHID().AppendDescriptor(node);
 
     // Setup Joystick State
 	if (_buttonCount > 0) {
@@ -589,6 +604,14 @@ if (_hatSwitchCount > 0) {
 	_hidReportSize += (axisCount * 2);
 	_hidReportSize += (simulationCount * 2);
 
+	// Register the report buffer, instances share the IN endpoint in turn
+	uint8_t* hidReportData = new uint8_t[_hidReportSize + 1];
+	memset(hidReportData, 0, _hidReportSize + 1);
+	hidReportData[0] = _hidReportId;
+	_hidReport = new DynamicHIDReport(hidReportData, _hidReportSize + 1);
+	if (_hidReportId)
+		DynamicHID().AddReport(_hidReport);
+
     _xAxis = 0;
     _yAxis = 0;
     _zAxis = 0;
@@ -1038,223 +1061,404 @@ void Joystick_::getUSBPID()
 
 void Joystick_::getForce(int32_t* forces) 
 {
+#if DYNAMIC_HID_STATS
+	uint32_t start = FFB_TIME_NOW();
+#endif
 	forceCalculator(forces);
+	// effect start/stop and device state changes go back to the host as PID State reports
+	DynamicHID().SendPIDState();
+	// input reports of all instances that did not fit into the endpoint yet
+	DynamicHID().SendReports();
+	DYNAMIC_HID_STAT(DynamicHID().StatTime(DynamicHID().stats.maxForceUs, start));
 }
 
-int32_t Joystick_::getEffectForce(volatile TEffectState& effect, Gains _gains, EffectParams _effect_params, uint8_t axis){
-	uint8_t direction;
+int32_t Joystick_::getEffectForce(volatile TEffectState& effect, const EffectParams& _effect_params, uint8_t axis){
     uint8_t condition;
-	bool useForceDirectionForConditionEffect = (effect.enableAxis == DIRECTION_ENABLE && effect.conditionBlocksCount == 1);
 
-    if (effect.enableAxis == DIRECTION_ENABLE)
+    if (effect.enableAxis == DIRECTION_ENABLE && effect.conditionBlocksCount <= 1)
     {
-        direction = effect.directionX;
-		if (effect.conditionBlocksCount > 1) {
-            condition = axis;
-        } else {
-	        condition = 0; // only one Condition Parameter Block is defined
-		}
+        condition = 0; // only one Condition Parameter Block is defined
     }
     else
     {
-        direction = axis == 0 ? effect.directionX : effect.directionY;
         condition = axis;
     }
 
-    float angle = (direction * 360.0 / 255.0) * DEG_TO_RAD;
-    float angle_ratio = axis == 0 ? sin(angle) : -1 * cos(angle);
+	// gains and direction are applied afterwards through effect.axisScale
 	int32_t force = 0;
 	switch (effect.effectType)
     {
 	    case USB_EFFECT_CONSTANT://1
-	        force = ConstantForceCalculator(effect) * _gains.constantGain * angle_ratio;
+	        force = ConstantForceCalculator(effect);
 	        break;
 	    case USB_EFFECT_RAMP://2
-	    	force = RampForceCalculator(effect) * _gains.rampGain * angle_ratio;
+	    	force = RampForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_SQUARE://3
-	    	force = SquareForceCalculator(effect) * _gains.squareGain * angle_ratio;
+	    	force = SquareForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_SINE://4
-	    	force = SinForceCalculator(effect) * _gains.sineGain * angle_ratio;
+	    	force = SinForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_TRIANGLE://5
-	    	force = TriangleForceCalculator(effect) * _gains.triangleGain * angle_ratio;
+	    	force = TriangleForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_SAWTOOTHDOWN://6
-	    	force = SawtoothDownForceCalculator(effect) * _gains.sawtoothdownGain * angle_ratio;
+	    	force = SawtoothDownForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_SAWTOOTHUP://7
-	    	force = SawtoothUpForceCalculator(effect) * _gains.sawtoothupGain * angle_ratio;
+	    	force = SawtoothUpForceCalculator(effect);
 	    	break;
 	    case USB_EFFECT_SPRING://8
-	    	force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.springPosition, _effect_params.springMaxPosition), condition) * _gains.springGain;
-	    	if (useForceDirectionForConditionEffect) {
-				force *= angle_ratio;
-			}
+	    	force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.springPosition, _effect_params.springMaxPosition), condition);
 			break;
 	    case USB_EFFECT_DAMPER://9
-	    	force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.damperVelocity, _effect_params.damperMaxVelocity), condition) * _gains.damperGain;
-	    	if (useForceDirectionForConditionEffect) {
-				force *= angle_ratio;
-			}
+	    	force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.damperVelocity, _effect_params.damperMaxVelocity), condition);
 			break;
 	    case USB_EFFECT_INERTIA://10
 	    	if (_effect_params.inertiaAcceleration < 0 && _effect_params.frictionPositionChange < 0) {
-	    		force = ConditionForceCalculator(effect, abs(NormalizeRange(_effect_params.inertiaAcceleration, _effect_params.inertiaMaxAcceleration)), condition) * _gains.inertiaGain;
+	    		force = ConditionForceCalculator(effect, abs(NormalizeRange(_effect_params.inertiaAcceleration, _effect_params.inertiaMaxAcceleration)), condition);
 	    	}
 	    	else if (_effect_params.inertiaAcceleration < 0 && _effect_params.frictionPositionChange > 0) {
-	    		force = -1 * ConditionForceCalculator(effect, abs(NormalizeRange(_effect_params.inertiaAcceleration, _effect_params.inertiaMaxAcceleration)), condition) * _gains.inertiaGain;
+	    		force = -1 * ConditionForceCalculator(effect, abs(NormalizeRange(_effect_params.inertiaAcceleration, _effect_params.inertiaMaxAcceleration)), condition);
 	    	}
-			if (useForceDirectionForConditionEffect) {
-				force *= angle_ratio;
-			}
 	    	break;
 	    case USB_EFFECT_FRICTION://11
-	    		force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.frictionPositionChange, _effect_params.frictionMaxPositionChange), condition) * _gains.frictionGain;
-	    		if (useForceDirectionForConditionEffect) {
-				    force *= angle_ratio;
-			    }
+	    		force = ConditionForceCalculator(effect, NormalizeRange(_effect_params.frictionPositionChange, _effect_params.frictionMaxPositionChange), condition);
 				break;
 	    case USB_EFFECT_CUSTOM://12
+	    		force = CustomForceCalculator(effect);
 	    		break;
 	    }
-	    effect.elapsedTime = (uint64_t)millis() - effect.startTime;
 		return force;
 }
 
+uint8_t Joystick_::EffectTypeGain(const Gains& _gains, uint8_t effectType)
+{
+	switch (effectType)
+	{
+		case USB_EFFECT_CONSTANT: return _gains.constantGain;
+		case USB_EFFECT_RAMP: return _gains.rampGain;
+		case USB_EFFECT_SQUARE: return _gains.squareGain;
+		case USB_EFFECT_SINE: return _gains.sineGain;
+		case USB_EFFECT_TRIANGLE: return _gains.triangleGain;
+		case USB_EFFECT_SAWTOOTHDOWN: return _gains.sawtoothdownGain;
+		case USB_EFFECT_SAWTOOTHUP: return _gains.sawtoothupGain;
+		case USB_EFFECT_SPRING: return _gains.springGain;
+		case USB_EFFECT_DAMPER: return _gains.damperGain;
+		case USB_EFFECT_INERTIA: return _gains.inertiaGain;
+		case USB_EFFECT_FRICTION: return _gains.frictionGain;
+		case USB_EFFECT_CUSTOM: return _gains.customGain;
+		default: return 0;
+	}
+}
+
+void Joystick_::UpdateEffectScale(volatile TEffectState& effect)
+{
+	bool isCondition = (effect.effectType >= USB_EFFECT_SPRING && effect.effectType <= USB_EFFECT_FRICTION);
+	bool useDirection = !isCondition || (effect.enableAxis == DIRECTION_ENABLE && effect.conditionBlocksCount == 1);
+	// effect gain * device gain * output range, the per-axis gains are added below
+	float effectScale = (effect.gain / 255.0) * (DynamicHID().pidReportHandler.deviceGain.gain / 255.0) * m_forceOutputMax / 10000.0;
+
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+		float scale = effectScale * EffectTypeGain(m_gains[axis], effect.effectType) / FORCE_FEEDBACK_MAXGAIN
+			* m_gains[axis].totalGain / FORCE_FEEDBACK_MAXGAIN;
+		if (useDirection)
+			scale *= DirectionRatio(effect, axis);
+
+		// store as a 15-bit mantissa and a right shift so the tick is a 16x16 multiply
+		uint8_t shift = 0;
+		while (scale != 0 && fabs(scale) < 16384 && shift < 30) {
+			scale *= 2;
+			shift++;
+		}
+		effect.axisScale[axis].mantissa = (int16_t)constrain(lround(scale), -32767, 32767);
+		effect.axisScale[axis].shift = shift;
+	}
+	effect.scaleValid = 1;
+}
+
+// direction angle 0..255 (=0..360deg)
+static float DirectionSin(uint8_t angle)
+{
+	return FfbSine((uint16_t)(angle * 257U)) / 32767.0;
+}
+
+static float DirectionCos(uint8_t angle)
+{
+	return FfbSine((uint16_t)(angle * 257U + 0x4000)) / 32767.0;
+}
+
+float Joystick_::DirectionRatio(volatile TEffectState& effect, uint8_t axis)
+{
+	// without DirectionEnable X and Y keep their angle, the PID spec defines none for the axes after them,
+	// which follow their enable-axis bit at full strength
+	if (effect.enableAxis != DIRECTION_ENABLE) {
+		if (axis >= 2)
+			return (effect.enableAxis & (1 << axis)) ? 1 : 0;
+		return axis == 0 ? DirectionSin(effect.direction[0]) : -DirectionCos(effect.direction[axis]);
+	}
+	// spherical: the first angle turns in the X/Y plane (0 = -Y, 90deg = +X),
+	// each further angle tilts from the axes before towards the next axis
+	float ratio = axis == 0 ? DirectionSin(effect.direction[0]) :
+		axis == 1 ? -DirectionCos(effect.direction[0]) : DirectionSin(effect.direction[axis - 1]);
+	for (uint8_t tilt = max(axis, 1); tilt < MAX_FFB_AXIS_COUNT - 1; tilt++)
+		ratio *= DirectionCos(effect.direction[tilt]);
+	return ratio;
+}
+
+inline int32_t Joystick_::ApplyForceScale(int32_t force, volatile TForceScale& scale)
+{
+	force = constrain(force, -32767, 32767);
+	return ((int32_t)(int16_t)force * scale.mantissa) >> scale.shift;
+}
 
 void Joystick_::forceCalculator(int32_t* forces) {
-	forces[0] = 0;
-    forces[1] = 0;
-	    for (int id = 0; id < MAX_EFFECTS; id++) {
-	    	volatile TEffectState& effect = DynamicHID().pidReportHandler.g_EffectStates[id];
-	    	if ((effect.state == MEFFECTSTATE_PLAYING) &&
-	    		((effect.elapsedTime <= effect.duration) ||
-	    		(effect.duration == USB_DURATION_INFINITE)) && !DynamicHID().pidReportHandler.devicePaused)
+	FFB_PROFILE_SCOPE(FFB_PROFILE_FORCE);
+	FFB_AXIS_LOOP
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++)
+		forces[axis] = 0;
+	// one timebase read per tick, shared by all effects
+	uint32_t now = FFB_TIME_NOW();
+	uint32_t tickTime = now - m_lastForceTime;
+	m_lastForceTime = now;
+	// start, stop and repeat effects on schedule, only the playing ones are visited below
+	PIDReportHandler& pid = DynamicHID().pidReportHandler;
+#if FFB_LATENCY_STATS
+	// taken before the commit, a packet arriving in between counts one tick late rather than early
+	uint32_t latencyStamp;
+	bool latencyStamped = pid.TakeLatencyStamp(latencyStamp);
+#endif
+	// parameters written by the host since the last tick take effect together
+	pid.CommitEffects();
+	pid.RunScheduler(now, _buttonValues != NULL ? _buttonValues[0] : 0);
+	// damper, inertia and friction forces are summed per type and filtered once
+	int32_t filterForces[FORCE_FEEDBACK_FILTER_COUNT][MAX_FFB_AXIS_COUNT] = {};
+	    for (uint8_t id = pid.activeEffects; id != 0; id = pid.g_EffectStates[id].nextActive) {
+	    	volatile TEffectState& effect = pid.g_EffectStates[id];
+	    	// advance time and the periodic phase once per tick, shared by both axes
+	    	uint32_t elapsedUs = now - effect.startUs;
+	    	if (elapsedUs > FFB_TIME_MAX) {
+	    		// saturate instead of wrapping, infinite effects keep their phase
+	    		elapsedUs = FFB_TIME_MAX;
+	    		effect.startUs = now - FFB_TIME_MAX;
+	    	}
+	    	// an effect started during the last tick only advances by its own age
+	    	effect.phaseAccumulator += min(tickTime, elapsedUs) * effect.phaseIncrement;
+	    	effect.elapsedUs = elapsedUs;
+	    	if (!pid.devicePaused)
 	    	{
-				forces[0] += (int32_t)(getEffectForce(effect, m_gains[0], m_effect_params[0], 0));
-				forces[1] += (int32_t)(getEffectForce(effect, m_gains[1], m_effect_params[1], 1));
+				if (!effect.scaleValid) UpdateEffectScale(effect);
+				// only condition effects depend on the axis before scaling
+				bool isCondition = (effect.effectType >= USB_EFFECT_SPRING && effect.effectType <= USB_EFFECT_FRICTION);
+				int32_t force = 0;
+				uint8_t filter = effect.effectType - USB_EFFECT_DAMPER;
+				FFB_AXIS_LOOP
+				for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+					if (axis == 0 || isCondition) force = getEffectForce(effect, m_effect_params[axis], axis);
+					if (filter < FORCE_FEEDBACK_FILTER_COUNT && m_conditionFilter[filter][axis].coefficient)
+						filterForces[filter][axis] += ApplyForceScale(force, effect.axisScale[axis]);
+					else
+						forces[axis] += ApplyForceScale(force, effect.axisScale[axis]);
+				}
 	    	}
 	    }
-	forces[0] = (int32_t)((float)1.0 * forces[0] * m_gains[0].totalGain / 10000); // each effect gain * total effect gain = 10000
-	forces[1] = (int32_t)((float)1.0 * forces[1] * m_gains[1].totalGain / 10000); // each effect gain * total effect gain = 10000
-	forces[0] = map(forces[0], -10000, 10000, -250, 250);
-	forces[1] = map(forces[1], -10000, 10000, -250, 250);
+	for (uint8_t filter = 0; filter < FORCE_FEEDBACK_FILTER_COUNT; filter++) {
+		for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+			if (m_conditionFilter[filter][axis].coefficient)
+				forces[axis] += ApplyForceFilter(m_conditionFilter[filter][axis], filterForces[filter][axis]);
+		}
+	}
+	FFB_AXIS_LOOP
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+		forces[axis] = constrain(forces[axis], -m_forceOutputMax, m_forceOutputMax);
+		if (m_forceOutputCurve != nullptr)
+			forces[axis] = ApplyOutputCurve(forces[axis]);
+	}
+#if FFB_LATENCY_STATS
+	if (latencyStamped)
+		pid.AddLatency(FFB_TIME_NOW() - latencyStamp);
+#endif
+}
+
+int8_t Joystick_::setForceOutputRange(int32_t maximum)
+{
+	if (maximum < 1 || maximum > FORCE_FEEDBACK_OUTPUT_MAXIMUM)
+		return -1;
+	m_forceOutputMax = maximum;
+	if (m_forceOutputCurve != nullptr)
+		setForceOutputCurve(m_forceOutputCurve, m_forceOutputCurveSegments + 1);
+	DynamicHID().pidReportHandler.InvalidateForceScales();
+	return 0;
+}
+
+int8_t Joystick_::setForceOutputBits(uint8_t bits)
+{
+	if (bits < 2 || bits > 16)
+		return -1;
+	return setForceOutputRange((1L << (bits - 1)) - 1);
+}
+
+int8_t Joystick_::setForceOutputCurve(const uint16_t* curve, uint8_t points)
+{
+	if (curve == nullptr) {
+		m_forceOutputCurve = nullptr;
+		return 0;
+	}
+	if (points < 2 || points > FORCE_FEEDBACK_CURVE_MAX_POINTS)
+		return -1;
+	m_forceOutputCurveSegments = points - 1;
+	// curve position of |force| in 8.8 fixed point is (|force| * step) >> 16, rounded up to reach the last point
+	m_forceOutputCurveStep = (((uint32_t)m_forceOutputCurveSegments << 24) + m_forceOutputMax - 1) / m_forceOutputMax;
+	m_forceOutputCurve = curve;
+	return 0;
+}
+
+inline int32_t Joystick_::ApplyOutputCurve(int32_t force)
+{
+	if (force == 0) return 0;
+	uint32_t magnitude = abs(force);
+	uint16_t position = (magnitude * m_forceOutputCurveStep) >> 16;
+	uint8_t index = min(position >> 8, m_forceOutputCurveSegments);
+	uint16_t value = pgm_read_word(&m_forceOutputCurve[index]);
+	if (index < m_forceOutputCurveSegments) {
+		int32_t next = pgm_read_word(&m_forceOutputCurve[index + 1]);
+		value += ((next - value) * (position & 0xFF)) >> 8;
+	}
+	int32_t output = ((uint32_t)value * m_forceOutputMax) >> 16;
+	return force < 0 ? -output : output;
 }
 
 int32_t Joystick_::ConstantForceCalculator(volatile TEffectState& effect) 
 {
+	FFB_PROFILE_SCOPE(FFB_PROFILE_CONSTANT);
 	return ApplyEnvelope(effect, (int32_t)effect.magnitude);
 }
 
 int32_t Joystick_::RampForceCalculator(volatile TEffectState& effect) 
 {
-	int32_t tempforce = (int32_t)(effect.startMagnitude + effect.elapsedTime * 1.0 * (effect.endMagnitude - effect.startMagnitude) / effect.duration);
+	FFB_PROFILE_SCOPE(FFB_PROFILE_RAMP);
+	int32_t tempforce = effect.endMagnitude;
+	if (effect.elapsedUs < effect.durationUs) {
+		uint16_t progress = (effect.elapsedUs * effect.rampStep) >> 16;
+		tempforce = effect.startMagnitude + ((((int32_t)effect.endMagnitude - effect.startMagnitude) * progress) >> 16);
+	}
 	return ApplyEnvelope(effect, tempforce);
 }
 
 int32_t Joystick_::SquareForceCalculator(volatile TEffectState& effect)
 {
-	int16_t offset = effect.offset * 2;
-	int16_t magnitude = effect.magnitude;
-	uint16_t phase = effect.phase;
-	uint16_t elapsedTime = effect.elapsedTime;
-	uint16_t period = effect.period;
-
-	int32_t maxMagnitude = offset + magnitude;
-	int32_t minMagnitude = offset - magnitude;
-	uint32_t phasetime = (phase * period) / 255;
-	uint32_t timeTemp = elapsedTime + phasetime;
-	uint32_t reminder = timeTemp % period;
-	int32_t tempforce;
-	if (reminder > (period / 2)) tempforce = minMagnitude;
-	else tempforce = maxMagnitude;
+	FFB_PROFILE_SCOPE(FFB_PROFILE_SQUARE);
+	volatile TEffectPeriodic& periodic = PeriodicBlock(effect);
+	int32_t tempforce = periodic.periodicMin;
+	if (PeriodicPhase(effect) < 0x8000) tempforce += periodic.periodicRange;
 	return ApplyEnvelope(effect, tempforce);
 }
 
 int32_t Joystick_::SinForceCalculator(volatile TEffectState& effect) 
 {
-	int16_t offset = effect.offset * 2;
-	int16_t magnitude = effect.magnitude;
-	uint16_t phase = effect.phase;
-	uint16_t timeTemp = effect.elapsedTime;
-	uint16_t period = effect.period;
-	float angle = 0.0;
-	if(period != 0)
-		angle = ((timeTemp * 1.0 / period) * 2 * PI + (phase / 36000.0));
-	float sine = sin(angle);
-	int32_t tempforce = (int32_t)(sine * magnitude);
-	tempforce += offset;
+	FFB_PROFILE_SCOPE(FFB_PROFILE_SINE);
+	volatile TEffectPeriodic& periodic = PeriodicBlock(effect);
+	// sine shifted to 1..65535 so the range multiply stays unsigned
+	uint16_t sine = FfbSine(PeriodicPhase(effect)) + 0x8000;
+	int32_t tempforce = periodic.periodicMin + (int32_t)(((uint32_t)periodic.periodicRange * sine) >> 16);
 	return ApplyEnvelope(effect, tempforce);
 }
 
 int32_t Joystick_::TriangleForceCalculator(volatile TEffectState& effect)
 {
-	int16_t offset = effect.offset * 2;
-	int16_t magnitude = effect.magnitude;
-	uint16_t elapsedTime = effect.elapsedTime;
-	uint16_t phase = effect.phase;
-	uint16_t period = effect.period;
-	uint16_t periodF = effect.period;
-
-	int16_t maxMagnitude = offset + magnitude;
-	int16_t minMagnitude = offset - magnitude;
-	int32_t phasetime = (phase * period) / 255;
-	uint32_t timeTemp = elapsedTime + phasetime;
-	int32_t reminder = timeTemp % period;
-	int32_t slope = ((maxMagnitude - minMagnitude) * 2) / periodF;
-	int32_t tempforce = 0;
-	if (reminder > (periodF / 2)) tempforce = slope * (periodF - reminder);
-	else tempforce = slope * reminder;
-	tempforce += minMagnitude;
+	FFB_PROFILE_SCOPE(FFB_PROFILE_TRIANGLE);
+	volatile TEffectPeriodic& periodic = PeriodicBlock(effect);
+	uint16_t phase = PeriodicPhase(effect);
+	// rises from min to max over the first half period, falls back over the second
+	uint16_t ramp = (phase & 0x8000) ? (uint16_t)(0 - phase) : phase;
+	int32_t tempforce = periodic.periodicMin + (int32_t)(((uint32_t)periodic.periodicRange * ramp) >> 15);
 	return ApplyEnvelope(effect, tempforce);
 }
 
 int32_t Joystick_::SawtoothDownForceCalculator(volatile TEffectState& effect) 
 {
-	int16_t offset = effect.offset * 2;
-	int16_t magnitude = effect.magnitude;
-	uint16_t elapsedTime = effect.elapsedTime;
-	uint16_t phase = effect.phase;
-	uint16_t period = effect.period;
-	uint16_t periodF = effect.period;
-
-	int16_t maxMagnitude = offset + magnitude;
-	int16_t minMagnitude = offset - magnitude;
-	int32_t phasetime = (phase * period) / 255;
-	uint32_t timeTemp = elapsedTime + phasetime;
-	int32_t reminder = timeTemp % period;
-	int32_t slope = (maxMagnitude - minMagnitude) / periodF;
-	int32_t tempforce = 0;
-	tempforce = slope * (period - reminder);
-	tempforce += minMagnitude;
+	FFB_PROFILE_SCOPE(FFB_PROFILE_SAWTOOTH_DOWN);
+	volatile TEffectPeriodic& periodic = PeriodicBlock(effect);
+	uint16_t fall = ~PeriodicPhase(effect);
+	int32_t tempforce = periodic.periodicMin + (int32_t)(((uint32_t)periodic.periodicRange * fall) >> 16);
 	return ApplyEnvelope(effect, tempforce);
 }
 
 int32_t Joystick_::SawtoothUpForceCalculator(volatile TEffectState& effect) 
 {
-	int16_t offset = effect.offset * 2;
-	int16_t magnitude = effect.magnitude;
-	uint16_t elapsedTime = effect.elapsedTime;
-	uint16_t phase = effect.phase;
-	uint16_t period = effect.period;
-	uint16_t periodF = effect.period;
-
-	int16_t maxMagnitude = offset + magnitude;
-	int16_t minMagnitude = offset - magnitude;
-	int32_t phasetime = (phase * period) / 255;
-	uint32_t timeTemp = elapsedTime + phasetime;
-	int32_t reminder = timeTemp % period;
-	int32_t slope = (maxMagnitude - minMagnitude) / periodF;
-	int32_t tempforce = 0;
-	tempforce = slope * reminder;
-	tempforce += minMagnitude;
+	FFB_PROFILE_SCOPE(FFB_PROFILE_SAWTOOTH_UP);
+	volatile TEffectPeriodic& periodic = PeriodicBlock(effect);
+	int32_t tempforce = periodic.periodicMin + (int32_t)(((uint32_t)periodic.periodicRange * PeriodicPhase(effect)) >> 16);
 	return ApplyEnvelope(effect, tempforce);
 }
 
+int32_t Joystick_::CustomForceCalculator(volatile TEffectState& effect)
+{
+	FFB_PROFILE_SCOPE(FFB_PROFILE_CUSTOM);
+	uint8_t sampleCount = effect.sampleCount;
+	if (sampleCount == 0) return 0;
+	// position in the ring in 8.8 fixed point, interpolated towards the next sample
+	uint16_t position = ((effect.phaseAccumulator >> 16) * sampleCount) >> 8;
+	uint8_t index = position >> 8;
+	uint8_t next = index + 1 < sampleCount ? index + 1 : 0;
+	volatile int8_t* samples = &DynamicHID().pidReportHandler.customForcePool[effect.customBlock * CUSTOM_FORCE_BLOCK_SIZE];
+	int32_t value = ((int32_t)samples[index] << 8) + (int32_t)(samples[next] - samples[index]) * (uint8_t)position;
+	// samples -127..127 map to -10000..10000
+	return ApplyEnvelope(effect, (value * 315) >> 10);
+}
+
+int8_t Joystick_::setConditionFilter(uint8_t effectType, uint16_t cutoff, uint16_t tickRate)
+{
+	uint8_t filter = effectType - USB_EFFECT_DAMPER;
+	if (filter >= FORCE_FEEDBACK_FILTER_COUNT || tickRate == 0)
+		return -1;
+	// smoothing factor of an exponential moving average at the tick rate
+	uint16_t coefficient = 0;
+	if (cutoff > 0)
+		coefficient = max(1.0, (1 - exp(-2 * PI * cutoff / tickRate)) * 16384 + 0.5);
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++) {
+		m_conditionFilter[filter][axis].coefficient = coefficient;
+		m_conditionFilter[filter][axis].state = 0;
+	}
+	return 0;
+}
+
+#if FFB_LATENCY_STATS
+void Joystick_::printLatency(Print& out)
+{
+	const FFBLatencyStats& latency = *(const FFBLatencyStats*)DynamicHID().pidReportHandler.getLatency();
+	out.print(F("latency n="));
+	out.print(latency.count);
+	out.print(F(" min="));
+	out.print(latency.count ? latency.minUs : 0);
+	out.print(F(" avg="));
+	out.print(latency.count ? latency.totalUs / latency.count : 0);
+	out.print(F(" p99="));
+	out.print(latency.p99Us);
+	out.print(F(" max="));
+	out.println(latency.maxUs);
+	for (uint8_t bin = 0; bin < FFB_LATENCY_BINS; bin++) {
+		if (!latency.bins[bin])
+			continue;
+		out.print(bin == FFB_LATENCY_BINS - 1 ? F(" >=") : F(" <"));
+		out.print((uint32_t)(bin + (bin != FFB_LATENCY_BINS - 1)) << FFB_LATENCY_BIN_SHIFT);
+		out.print(F(": "));
+		out.println(latency.bins[bin]);
+	}
+}
+#endif
+
+inline int32_t Joystick_::ApplyForceFilter(ForceFilter& filter, int32_t force)
+{
+	force = constrain(force, -m_forceOutputMax, m_forceOutputMax);
+	filter.state += (force - (filter.state >> 14)) * filter.coefficient;
+	return filter.state >> 14;
+}
+
 int32_t Joystick_::ConditionForceCalculator(volatile TEffectState& effect, float metric, uint8_t axis)
 {
+	FFB_PROFILE_SCOPE(FFB_PROFILE_CONDITION);
 	float deadBand;
 	float cpOffset;
 	float positiveCoefficient;
@@ -1262,12 +1466,13 @@ int32_t Joystick_::ConditionForceCalculator(volatile TEffectState& effect, float
 	float positiveSaturation;
 	float negativeSaturation;
 
-    deadBand = effect.conditions[axis].deadBand;
-    cpOffset = effect.conditions[axis].cpOffset;
-    negativeCoefficient = effect.conditions[axis].negativeCoefficient;
-    negativeSaturation = effect.conditions[axis].negativeSaturation;
-    positiveSaturation = effect.conditions[axis].positiveSaturation;
-    positiveCoefficient = effect.conditions[axis].positiveCoefficient;
+	volatile TEffectCondition& condition = DynamicHID().pidReportHandler.conditionBlocks[effect.conditionBlock[axis]];
+    deadBand = condition.deadBand;
+    cpOffset = condition.cpOffset;
+    negativeCoefficient = condition.negativeCoefficient;
+    negativeSaturation = condition.negativeSaturation;
+    positiveSaturation = condition.positiveSaturation;
+    positiveCoefficient = condition.positiveCoefficient;
 
 	float  tempForce = 0;
 	if (metric < (cpOffset - deadBand)) 
@@ -1281,57 +1486,103 @@ int32_t Joystick_::ConditionForceCalculator(volatile TEffectState& effect, float
 		tempForce = (tempForce > positiveSaturation ? positiveSaturation : tempForce);
 	}
 	else return 0;
-	tempForce = -tempForce * effect.gain / 255;
-	switch (effect.effectType) {
-	case  USB_EFFECT_DAMPER:
-		//tempForce = damperFilter.filterIn(tempForce);
-		break;
-	case USB_EFFECT_INERTIA:
-		//tempForce = interiaFilter.filterIn(tempForce);
-		break;
-	case USB_EFFECT_FRICTION:
-		//tempForce = frictionFilter.filterIn(tempForce);
-		break;
-	default:
-		break;
-	}
+	tempForce = -tempForce;
+	// damper, inertia and friction are low-pass filtered per axis in forceCalculator, see setConditionFilter
 	return (int32_t)tempForce;
 }
 
+inline volatile TEffectPeriodic& Joystick_::PeriodicBlock(volatile TEffectState& effect)
+{
+	return DynamicHID().pidReportHandler.periodicBlocks[effect.periodicBlock];
+}
+
+inline uint16_t Joystick_::PeriodicPhase(volatile TEffectState& effect)
+{
+	return PeriodicBlock(effect).phase + (uint16_t)(effect.phaseAccumulator >> 16);
+}
+
 inline float Joystick_::NormalizeRange(int32_t x, int32_t maxValue) {
 	return (float)x * 1.00 / maxValue;
 }
 
-inline int32_t  Joystick_::ApplyGain(int16_t value, uint8_t gain)
-{
-	int32_t value_32 = value;
-	return ((value_32 * gain) / 255);
+int8_t Joystick_::setMotionEstimator(uint16_t tickRate, uint8_t smoothing)
+{
+	if (tickRate == 0)
+		return -1;
+	// fading memory alpha-beta-gamma gains for discount factor theta
+	float theta = smoothing / 256.0;
+	float rest = 1 - theta;
+	m_estimatorRate = tickRate;
+	m_estimatorAlpha = (1 - theta * theta * theta) * 4096 + 0.5;
+	m_estimatorBeta = 1.5 * (1 - theta * theta) * rest * 4096 + 0.5;
+	m_estimatorGamma = rest * rest * rest * 4096 + 0.5;
+	for (uint8_t axis = 0; axis < MAX_FFB_AXIS_COUNT; axis++)
+		m_axisEstimate[axis].valid = false;
+	return 0;
+}
+
+void Joystick_::updateAxisPosition(uint8_t axis, int32_t position)
+{
+	if (axis >= MAX_FFB_AXIS_COUNT || m_effect_params == nullptr)
+		return;
+	if (m_estimatorRate == 0)
+		setMotionEstimator(FORCE_FEEDBACK_TICK_RATE);
+
+	AxisEstimate& estimate = m_axisEstimate[axis];
+	int32_t measured = position << 8; // Q8, velocity Q12, acceleration Q16
+	uint32_t now = FFB_TIME_NOW();
+	if (!estimate.valid) {
+		estimate.position = measured;
+		estimate.velocity = 0;
+		estimate.acceleration = 0;
+		estimate.valid = true;
+	}
+	else {
+		// time since the last call in ticks of 1/tickRate s, Q8 held to 0.5..2 ticks; x / 3906.25 as (x * 1074) >> 22
+		uint32_t elapsed = min(now - estimate.lastUs, (uint32_t)0xFFFF) * m_estimatorRate;
+		int32_t ticks = (constrain(elapsed, 500000UL, 2000000UL) * 1074 + 0x200000) >> 22;
+		int32_t inverse = (uint16_t)(0x8000 + (ticks >> 2)) / (uint16_t)(ticks >> 1); // Q8 of 1 / ticks
+
+		// predict that far ahead and correct by the residual, the rate gains scale by 1 / ticks and 1 / ticks^2;
+		// jumps beyond 1024 counts are clipped
+		int32_t predicted = estimate.position + (((estimate.velocity >> 4) * ticks) >> 8)
+			+ (((((estimate.acceleration >> 8) * ticks) >> 8) * ticks) >> 9);
+		int32_t residual = constrain(measured - predicted, -0x3FFFFL, 0x3FFFFL);
+		int32_t accelerationStep = (residual * m_estimatorGamma + 8) >> 4;
+		accelerationStep = ((accelerationStep >> 6) * inverse) >> 2;
+		accelerationStep = ((accelerationStep >> 6) * inverse) >> 2;
+		estimate.position = predicted + ((residual * m_estimatorAlpha + 2048) >> 12);
+		estimate.velocity += (((estimate.acceleration >> 8) * ticks) >> 4) + ((((residual * m_estimatorBeta) >> 12) * inverse) >> 4);
+		estimate.acceleration += accelerationStep;
+	}
+	estimate.lastUs = now;
+
+	EffectParams& params = m_effect_params[axis];
+	params.springPosition = position;
+	params.damperVelocity = ((estimate.velocity >> 4) * m_estimatorRate) >> 8;
+	// Q16 counts/tick^2 to counts/s^2 in two steps through Q4, the rate is applied before shifting to keep the fraction
+	params.inertiaAcceleration = (((estimate.acceleration * m_estimatorRate) >> 12) * m_estimatorRate) >> 4;
+	params.frictionPositionChange = (estimate.velocity + 2048) >> 12;
 }
 
 inline int32_t Joystick_::ApplyEnvelope(volatile TEffectState& effect, int32_t value)
 {
-	int32_t magnitude = ApplyGain(effect.magnitude, effect.gain);
-	int32_t attackLevel = ApplyGain(effect.attackLevel, effect.gain);
-	int32_t fadeLevel = ApplyGain(effect.fadeLevel, effect.gain);
-	int32_t newValue = magnitude;
-	int32_t attackTime = effect.attackTime;
-	int32_t fadeTime = effect.fadeTime;
-	int32_t elapsedTime = effect.elapsedTime;
-	int32_t duration = effect.duration;
+	if (!effect.hasEnvelope) return value;
 
-	if (elapsedTime < attackTime)
+	// levels and progress steps are precomputed by PIDReportHandler::UpdateEnvelope
+	uint16_t scale = ENVELOPE_SCALE_ONE;
+	uint32_t elapsedUs = effect.elapsedUs;
+	if (elapsedUs < effect.attackTimeUs)
 	{
-		newValue = (magnitude - attackLevel) * elapsedTime / attackTime;
-		newValue += attackLevel;
+		uint16_t progress = (elapsedUs * effect.attackStep) >> 17;
+		scale = effect.attackScale + ((((int32_t)ENVELOPE_SCALE_ONE - effect.attackScale) * progress) >> 15);
 	}
-	if (elapsedTime > (duration - fadeTime))
+	else if (elapsedUs > effect.fadeStartUs)
 	{
-		newValue = (magnitude - fadeLevel) * (duration - elapsedTime);
-		newValue /= fadeTime;
-		newValue += fadeLevel;
+		uint16_t progress = ((elapsedUs - effect.fadeStartUs) * effect.fadeStep) >> 17;
+		scale = ENVELOPE_SCALE_ONE + ((((int32_t)effect.fadeScale - ENVELOPE_SCALE_ONE) * progress) >> 15);
 	}
-	newValue = newValue * value / magnitude;
-	return newValue;
+	return (value * scale) >> ENVELOPE_SCALE_SHIFT;
 }
 
 void Joystick_::end()
@@ -1622,6 +1873,7 @@ void Joystick_::setHatSwitch(int8_t hatSwitchIndex, int16_t value)
 
 int Joystick_::buildAndSet16BitValue(bool includeValue, int16_t value, int16_t valueMinimum, int16_t valueMaximum, int16_t actualMinimum, int16_t actualMaximum, uint8_t dataLocation[]) 
 {
+	FFB_PROFILE_SCOPE(FFB_PROFILE_BUILD_16BIT);
 	int16_t convertedValue;
 	uint8_t highByte;
 	uint8_t lowByte;
@@ -1665,7 +1917,9 @@ int Joystick_::buildAndSetSimulationValue(bool includeValue, int16_t value, int1
 
 void Joystick_::sendState()
 {
-	uint8_t data[_hidReportSize];
+	FFB_PROFILE_SCOPE(FFB_PROFILE_SEND_STATE);
+	// built in place, a report not sent yet is replaced by this state
+	uint8_t* data = &_hidReport->data[1];
 	int index = 0;
 	
 	// Load Button State
@@ -1740,7 +1994,7 @@ void Joystick_::sendState()
     index += buildAndSetSimulationValue(_includeSimulatorFlags & JOYSTICK_INCLUDE_TURRETY, _turrety, _turretyMinimum, _turretyMaximum, &(data[index]));
     index += buildAndSetSimulationValue(_includeSimulatorFlags & JOYSTICK_INCLUDE_TURRETZ, _turretz, _turretzMinimum, _turretzMaximum, &(data[index]));
 
-	DynamicHID().SendReport(_hidReportId, data, _hidReportSize);
+	DynamicHID().QueueReport(_hidReport);
 }
     } // namespace JoystickFfb
 } // namespace S418
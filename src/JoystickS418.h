@@ -42,7 +42,7 @@
 //================================================================================
 //  Joystick (Gamepad)
 
-#define JOYSTICK_DEFAULT_REPORT_ID         0x01
+#define JOYSTICK_DEFAULT_REPORT_ID         DYNAMIC_HID_FIRST_REPORT_ID // IDs below are PID reports, see Joystick_::init
 #define JOYSTICK_DEFAULT_BUTTON_COUNT        32
 #define JOYSTICK_DEFAULT_AXIS_MINIMUM         0
 #define JOYSTICK_DEFAULT_AXIS_MAXIMUM      1023
@@ -55,10 +55,12 @@
 #define JOYSTICK_TYPE_GAMEPAD              0x05
 #define JOYSTICK_TYPE_MULTI_AXIS           0x08
 
-#define DIRECTION_ENABLE                   0x04
-#define X_AXIS_ENABLE                      0x01
-#define Y_AXIS_ENABLE                      0x02
 #define FORCE_FEEDBACK_MAXGAIN              100
+#define FORCE_FEEDBACK_DEFAULT_OUTPUT_MAXIMUM 250
+#define FORCE_FEEDBACK_OUTPUT_MAXIMUM     32767
+#define FORCE_FEEDBACK_CURVE_MAX_POINTS      33
+#define FORCE_FEEDBACK_TICK_RATE           1000
+#define FORCE_FEEDBACK_ESTIMATOR_SMOOTHING  192
 #define DEG_TO_RAD              ((float)((float)3.14159265359 / 180.0))
 
 typedef uint32_t axis_flags_t;
@@ -94,6 +96,22 @@ struct EffectParams{
     int32_t frictionPositionChange = 0;
 };
 
+//motion estimator state of one axis, fixed point in counts and ticks
+struct AxisEstimate{
+    int32_t position = 0;
+    int32_t velocity = 0;
+    int32_t acceleration = 0;
+    uint32_t lastUs = 0; // time of the last update, see FFB_TIME_NOW
+    bool valid = false;
+};
+
+//one-pole low-pass filter, coefficient and state in Q14
+struct ForceFilter{
+    uint16_t coefficient = 0; // 0 = pass-through
+    int32_t state = 0;
+};
+#define FORCE_FEEDBACK_FILTER_COUNT           3 // damper, inertia, friction
+
 
 namespace S418 {
     namespace JoystickFfb {
@@ -242,6 +260,7 @@ private:
 
     uint8_t                  _hidReportId;
     uint8_t                  _hidReportSize;
+    DynamicHIDReport*        _hidReport; // report buffer, sent by DynamicHID().SendReports()
     uint8_t                  _joystickType;
 
     //force feedback gain
@@ -250,13 +269,31 @@ private:
     //force feedback effect params
     EffectParams* m_effect_params;
 
+    //force output range, forces are scaled to [-m_forceOutputMax, m_forceOutputMax]
+    int32_t m_forceOutputMax = FORCE_FEEDBACK_DEFAULT_OUTPUT_MAXIMUM;
+    //optional output linearization curve (PROGMEM)
+    const uint16_t* m_forceOutputCurve = nullptr;
+    uint8_t m_forceOutputCurveSegments = 0;
+    uint32_t m_forceOutputCurveStep = 0;
+    //timebase of the previous force tick, see FFB_TIME_NOW
+    uint32_t m_lastForceTime = 0;
+    //alpha-beta-gamma motion estimator, gains in Q12, 0 rate = not configured yet
+    AxisEstimate m_axisEstimate[MAX_FFB_AXIS_COUNT];
+    uint16_t m_estimatorRate = 0;
+    uint16_t m_estimatorAlpha = 0;
+    uint16_t m_estimatorBeta = 0;
+    uint16_t m_estimatorGamma = 0;
+    //low-pass filters of the damper, inertia and friction forces per axis
+    ForceFilter m_conditionFilter[FORCE_FEEDBACK_FILTER_COUNT][MAX_FFB_AXIS_COUNT];
+
     //lock data
     bool is_calculating_force = true;
 
     ///force calculate funtion
     float NormalizeRange(int32_t x, int32_t maxValue);
+    volatile TEffectPeriodic& PeriodicBlock(volatile TEffectState& effect);
+    uint16_t PeriodicPhase(volatile TEffectState& effect);
     int32_t ApplyEnvelope(volatile TEffectState& effect, int32_t value);
-    int32_t ApplyGain(int16_t value, uint8_t gain);
     int32_t ConstantForceCalculator(volatile TEffectState& effect);
     int32_t RampForceCalculator(volatile TEffectState& effect);
     int32_t SquareForceCalculator(volatile TEffectState& effect);
@@ -264,9 +301,16 @@ private:
     int32_t TriangleForceCalculator(volatile TEffectState& effect);
     int32_t SawtoothDownForceCalculator(volatile TEffectState& effect);
     int32_t SawtoothUpForceCalculator(volatile TEffectState& effect);
+    int32_t CustomForceCalculator(volatile TEffectState& effect);
     int32_t ConditionForceCalculator(volatile TEffectState& effect, float metric, uint8_t axis);
     void forceCalculator(int32_t* forces);
-    int32_t getEffectForce(volatile TEffectState& effect, Gains _gains, EffectParams _effect_params, uint8_t axis);
+    int32_t getEffectForce(volatile TEffectState& effect, const EffectParams& _effect_params, uint8_t axis);
+    uint8_t EffectTypeGain(const Gains& _gains, uint8_t effectType);
+    void UpdateEffectScale(volatile TEffectState& effect);
+    float DirectionRatio(volatile TEffectState& effect, uint8_t axis);
+    int32_t ApplyForceScale(int32_t force, volatile TForceScale& scale);
+    int32_t ApplyOutputCurve(int32_t force);
+    int32_t ApplyForceFilter(ForceFilter& filter, int32_t force);
 protected:
     int buildAndSet16BitValue(bool includeValue, int16_t value, int16_t valueMinimum, int16_t valueMaximum, int16_t actualMinimum, int16_t actualMaximum, uint8_t dataLocation[]);
     int buildAndSetAxisValue(bool includeAxis, int16_t axisValue, int16_t axisMinimum, int16_t axisMaximum, uint8_t dataLocation[]);
@@ -638,6 +682,9 @@ public:
     void setHatSwitch(int8_t hatSwitch, int16_t value);
 
     void sendState();
+    // sends the reports a busy USB endpoint held back, true while the last sendState() is still queued;
+    // sendState() never blocks, call this from loop() so a last change is not left unsent
+    bool sendPending() { DynamicHID().SendReports(); return _hidReport->pending; }
     // get USB PID data
     void getUSBPID();
     //force feedback Interfaces
@@ -647,10 +694,27 @@ public:
         if(_gains != nullptr){
             //it should be added some limition here,but im so tired,it's 2:24 A.M now!
             m_gains = _gains;
+            DynamicHID().pidReportHandler.InvalidateForceScales();
             return 0;
         }
         return -1;
     };
+    /* set force output range
+     * getForce() returns forces in [-maximum, maximum], maximum 1..32767 (default 250)
+     * return 0 ：set range successful
+     *        -1：set range failed
+    */
+    int8_t setForceOutputRange(int32_t maximum);
+    //same as setForceOutputRange((1 << (bits - 1)) - 1), bits 2..16
+    int8_t setForceOutputBits(uint8_t bits);
+    /* set force output linearization curve
+     * param:a PROGMEM <uint16_t> array of 2..33 points, evenly spaced over |force| 0..maximum,
+     *       each point is the output for that force as a fraction of maximum (0..65535)
+     *       nullptr disables the curve
+     * return 0 ：set curve successful
+     *        -1：set curve failed
+    */
+    int8_t setForceOutputCurve(const uint16_t* curve, uint8_t points);
     //set effect params funtions
     int8_t setEffectParams(EffectParams* _effect_params){
         if(_effect_params != nullptr){
@@ -659,6 +723,35 @@ public:
         }
         return -1;
     };
+    /* set motion estimator
+     * param:tickRate  nominal rate of updateAxisPosition() calls in Hz (default 1000), the outputs are per tick of it
+     *       smoothing 0..255, 0 follows the raw position, higher values filter more (default 192)
+     * return 0 ：set estimator successful
+     *        -1：set estimator failed
+    */
+    int8_t setMotionEstimator(uint16_t tickRate, uint8_t smoothing = FORCE_FEEDBACK_ESTIMATOR_SMOOTHING);
+    /* feed the raw position of an axis about once per tick, fills the effect params of that axis:
+     * springPosition = position, damperVelocity in counts/s, inertiaAcceleration in counts/s^2,
+     * frictionPositionChange in counts per tick; the max values stay up to the sketch
+     * the time between calls is measured with FFB_TIME_NOW(), gaps beyond 0.5..2 ticks count as 0.5 or 2
+     * requires setEffectParams(), |position| < 2^23
+    */
+    void updateAxisPosition(uint8_t axis, int32_t position);
+    /* set condition force filter
+     * low-pass filters the summed force of one condition effect type per axis
+     * param:effectType USB_EFFECT_DAMPER, USB_EFFECT_INERTIA or USB_EFFECT_FRICTION
+     *       cutoff     cutoff frequency in Hz, 0 disables the filter (default)
+     *       tickRate   rate of getForce() calls in Hz
+     * return 0 ：set filter successful
+     *        -1：set filter failed
+    */
+    int8_t setConditionFilter(uint8_t effectType, uint16_t cutoff, uint16_t tickRate = FORCE_FEEDBACK_TICK_RATE);
+#if FFB_LATENCY_STATS
+    /* print the host update latency (OUT packet to force, us), e.g. printLatency(Serial)
+     * one line with count/min/avg/p99/max, then the non-empty histogram bins
+    */
+    void printLatency(Print& out);
+#endif
 };
     } // namespace JoystickFfb
 } // namespace S418